@@ -0,0 +1,94 @@
+#include <vector>
+#include <memory>
+#include "benchmark/benchmark.h"
+#include "flock.h"
+
+/* Two flocks whose product has `size` arguments, the first one conditioned on the first argument of the second */
+static std::pair<std::unique_ptr<splittercell::flock>, std::unique_ptr<splittercell::flock>> split_flocks(unsigned int size) {
+    std::vector<unsigned int> args1, args2;
+    for(unsigned int i = 0; i < size / 2; i++)
+        args1.push_back(i);
+    for(unsigned int i = size / 2; i < size; i++)
+        args2.push_back(i);
+    return std::make_pair(std::make_unique<splittercell::flock>(args1, std::vector<unsigned int>({size / 2})),
+                          std::make_unique<splittercell::flock>(args2));
+}
+
+/* The per-model bit loop flock::mt_combine used before the product plans, kept as a reference point */
+static void legacy_combine(const splittercell::flock &f1, const splittercell::flock &f2, const splittercell::flock &combined, std::vector<double> &out) {
+    std::vector<std::pair<unsigned int, unsigned int>> splitindex(combined.size());
+    for(auto args : {combined.conditioned(), combined.conditioning()})
+        for(auto arg : args) {
+            unsigned int j = combined.index(arg), first = 0, second = 0;
+            for(auto a : f1.conditioned()) if(a == arg) first = f1.index(arg) + 1;
+            for(auto a : f1.conditioning()) if(a == arg) first = f1.index(arg) + 1;
+            for(auto a : f2.conditioned()) if(a == arg) second = f2.index(arg) + 1;
+            splitindex[j] = std::make_pair(first, second);
+        }
+    for(unsigned int i = 0; i < out.size(); i++) {
+        unsigned int end1 = 0, end2 = 0;
+        for(unsigned int j = 0; j < combined.size(); j++) {
+            if(splitindex[j].first != 0)
+                end1 |= ((bool)(i & (1U << j)) << (splitindex[j].first - 1));
+            if(splitindex[j].second != 0)
+                end2 |= ((bool)(i & (1U << j)) << (splitindex[j].second - 1));
+        }
+        out[i] = f1.distribution()[end1] * f2.distribution()[end2];
+    }
+}
+
+static void BM_CombineLegacy(benchmark::State &state) {
+    auto flocks = split_flocks(state.range(0));
+    auto combined = flocks.first->combine(flocks.second.get(), false);
+    std::vector<double> out(combined->distribution().size());
+    for(auto _ : state) {
+        legacy_combine(*flocks.first, *flocks.second, *combined, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * out.size());
+}
+
+static void BM_Combine(benchmark::State &state) {
+    auto flocks = split_flocks(state.range(0));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(flocks.first->combine(flocks.second.get(), false));
+    state.SetItemsProcessed(state.iterations() * (1ULL << state.range(0)));
+}
+
+/* Arguments: product size, arguments of each flock refined with coefficient 1 (from 4 of them, the flocks are sparse) */
+static void BM_CombineCertain(benchmark::State &state) {
+    auto flocks = split_flocks(state.range(0));
+    for(unsigned int a = 0; a < state.range(1); a++) {
+        flocks.first->refine(a + 1, a % 2, 1.0);
+        flocks.second->refine(state.range(0) / 2 + a + 1, a % 2, 1.0);
+    }
+    for(auto _ : state)
+        benchmark::DoNotOptimize(flocks.first->combine(flocks.second.get(), false));
+    state.SetItemsProcessed(state.iterations() * (1ULL << state.range(0)));
+}
+
+/* Arguments: flock size, operation (refine, marginalize, combine, marginals). Flocks of the size most models use */
+static void BM_SmallFlock(benchmark::State &state) {
+    unsigned int size = state.range(0);
+    auto flocks = split_flocks(size);
+    std::vector<unsigned int> args(flocks.first->conditioned()), keep;
+    args.insert(args.end(), flocks.second->conditioned().cbegin(), flocks.second->conditioned().cend());
+    auto whole = flocks.first->combine(flocks.second.get(), false);
+    for(unsigned int a = 0; a < size; a += 2)
+        keep.push_back(args[a]);
+    for(auto _ : state)
+        switch(state.range(1)) {
+            case 0:
+                whole->refine(args[size / 2], true, 0.1);
+                whole->refine(args[size / 2], false, 0.1);
+                break;
+            case 1: benchmark::DoNotOptimize(whole->marginalize(keep, nullptr)); break;
+            case 2: benchmark::DoNotOptimize(flocks.first->combine(flocks.second.get(), false)); break;
+            default: benchmark::DoNotOptimize(whole->all_marginals());
+        }
+}
+
+BENCHMARK(BM_SmallFlock)->ArgsProduct({{2, 4, 6, 8}, {0, 1, 2, 3}});
+BENCHMARK(BM_CombineLegacy)->DenseRange(14, 28, 2)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Combine)->DenseRange(14, 28, 2)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_CombineCertain)->ArgsProduct({{20, 24, 28}, {0, 2, 4, 6}})->Unit(benchmark::kMillisecond);
@@ -0,0 +1,205 @@
+#include <random>
+#include <vector>
+#include <mutex>
+#include "benchmark/benchmark.h"
+#include "distribution.h"
+
+/* flocks flocks of size arguments each. Every flock but the first of each chain is conditioned on the first
+ * argument of the previous one, so the chains are depth flocks long (depth 1 for independent flocks). */
+static splittercell::distribution chain(unsigned int flocks, unsigned int size, unsigned int depth, unsigned int threads) {
+    std::vector<std::unique_ptr<splittercell::flock>> v;
+    for(unsigned int f = 0; f < flocks; f++) {
+        std::vector<unsigned int> args, cond;
+        for(unsigned int a = 0; a < size; a++)
+            args.push_back(f * size + a);
+        if(f % depth != 0)
+            cond.push_back((f - 1) * size);
+        v.push_back(std::make_unique<splittercell::flock>(args, cond));
+    }
+    splittercell::distribution d(v);
+    d.set_threads(threads);
+    for(unsigned int f = 0; f < flocks; f++) //Away from uniform, so that nothing is cached from the start
+        d.refine(f * size + size - 1, f % 2, 0.3);
+    return d;
+}
+
+static void threads_and(benchmark::internal::Benchmark *b, const std::vector<std::vector<int64_t>> &ranges) {
+    auto r = ranges;
+    r.push_back({1, 2, 4});
+    b->ArgsProduct(r);
+}
+
+/* Arguments: flock size, threads */
+static void BM_Refine(benchmark::State &state) {
+    auto d = chain(1, state.range(0), 1, state.range(1));
+    for(auto _ : state)
+        d.refine(state.range(0) / 2, true, 0.1);
+    state.SetItemsProcessed(state.iterations() << state.range(0));
+}
+BENCHMARK(BM_Refine)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{12, 16, 20, 24}});});
+
+/* Arguments: flock size, batched or not, threads. Four arguments refined each way, so the table stays away from
+ * denormals however many iterations run */
+static void BM_RefineMany(benchmark::State &state) {
+    unsigned int size = state.range(0);
+    auto d = chain(1, size, 1, state.range(2));
+    std::vector<splittercell::update> updates({{0, true, 0.1}, {size / 2, false, 0.2}, {size - 1, true, 0.1}, {size / 2, true, 0.3},
+                                               {size - 2, false, 0.2}, {0, false, 0.1}, {size - 1, false, 0.1}, {size - 2, true, 0.2}});
+    for(auto _ : state) {
+        if(state.range(1))
+            d.refine_batch(updates);
+        else
+            for(auto &u : updates)
+                d.refine(u.argument, u.positive, u.coefficient);
+    }
+    state.SetItemsProcessed(state.iterations() << size);
+}
+BENCHMARK(BM_RefineMany)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{12, 16, 20, 24}, {0, 1}});});
+
+/* Arguments: flock size, threads. Half of the arguments are kept */
+static void BM_Marginalize(benchmark::State &state) {
+    auto d = chain(1, state.range(0), 1, state.range(1));
+    std::vector<unsigned int> keep;
+    for(unsigned int a = 0; a < state.range(0); a += 2)
+        keep.push_back(a);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(d.marginalize(0, keep));
+    state.SetItemsProcessed(state.iterations() << state.range(0));
+}
+BENCHMARK(BM_Marginalize)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{12, 16, 20, 24}});});
+
+/* Arguments: flocks, chain depth, threads. Belief of the last argument of the model after a refinement of the
+ * argument the rest of its chain hangs on and of the argument itself, so the whole chain is eliminated again */
+static void BM_Query(benchmark::State &state) {
+    unsigned int flocks = state.range(0), size = 4, depth = state.range(1);
+    auto d = chain(flocks, size, depth, state.range(2));
+    std::vector<unsigned int> last({flocks * size - 1});
+    for(auto _ : state) {
+        d.refine((flocks - 1) / depth * depth * size, true, 0.01);
+        d.refine(last[0], true, 0.01);
+        benchmark::DoNotOptimize(d[last]);
+    }
+}
+BENCHMARK(BM_Query)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{4, 16, 64}, {1, 4, 16}});});
+
+/* Arguments: flocks, chain depth, threads. Same query as BM_Query, answered by sampling to within 0.01 */
+static void BM_Approximate(benchmark::State &state) {
+    unsigned int flocks = state.range(0), size = 4;
+    auto d = chain(flocks, size, state.range(1), state.range(2));
+    splittercell::sampling_budget budget;
+    budget.seconds = 0;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(d.approximate({flocks * size - 1}, budget));
+}
+BENCHMARK(BM_Approximate)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{16, 64}, {4, 16}});})->Unit(benchmark::kMillisecond);
+
+/* Arguments: flocks, chain depth, what_if or not, threads. A planner weighing 24 candidate moves by the beliefs they
+ * would lead to, either through what_if or by copying the distribution and refining the copy for each one */
+static void BM_Planner(benchmark::State &state) {
+    unsigned int flocks = state.range(0), size = 6;
+    auto d = chain(flocks, size, state.range(1), state.range(3));
+    std::mt19937 moves(42);
+    std::uniform_int_distribution<unsigned int> argument(0, flocks * size - 1);
+    std::vector<splittercell::update> candidates;
+    for(unsigned int c = 0; c < 24; c++)
+        candidates.push_back({argument(moves), c % 2 == 0, 0.05 + c / 100.0});
+    std::vector<unsigned int> targets;
+    for(unsigned int a = 0; a < flocks * size; a += size)
+        targets.push_back(a);
+    d.beliefs_all();
+    for(auto _ : state) {
+        if(state.range(2))
+            benchmark::DoNotOptimize(d.what_if(candidates, targets));
+        else
+            for(auto &c : candidates) {
+                splittercell::distribution copy(d);
+                copy.refine(c.argument, c.positive, c.coefficient);
+                benchmark::DoNotOptimize(copy[targets]);
+            }
+    }
+    state.SetItemsProcessed(state.iterations() * candidates.size());
+}
+BENCHMARK(BM_Planner)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{12, 32}, {1, 4}, {0, 1}});});
+
+/* Arguments: flocks, through published snapshots or a mutex around the distribution. Every thread reads all the
+ * beliefs, thread 0 also refines an argument every 16 reads (and publishes the result with snapshots). */
+static void BM_SharedReaders(benchmark::State &state) {
+    static std::unique_ptr<splittercell::distribution> d;
+    static std::mutex m;
+    unsigned int flocks = state.range(0), size = 6, reads = 0;
+    if(state.thread_index() == 0) {
+        d = std::make_unique<splittercell::distribution>(chain(flocks, size, 4, 1));
+        d->publish();
+    }
+    std::vector<unsigned int> targets;
+    for(unsigned int a = 0; a < flocks * size; a++)
+        targets.push_back(a);
+    for(auto _ : state) {
+        bool write = state.thread_index() == 0 && ++reads % 16 == 0;
+        if(state.range(1)) {
+            if(write) {
+                d->refine(size, reads / 16 % 2, 0.1);
+                d->publish();
+            }
+            benchmark::DoNotOptimize((*d->published())[targets]);
+        } else {
+            std::lock_guard<std::mutex> lock(m);
+            if(write)
+                d->refine(size, reads / 16 % 2, 0.1);
+            benchmark::DoNotOptimize((*d)[targets]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedReaders)->ArgsProduct({{12, 32}, {0, 1}})->ThreadRange(1, 4)->UseRealTime();
+
+/* Arguments: flocks, flock size */
+static void BM_Copy(benchmark::State &state) {
+    auto d = chain(state.range(0), state.range(1), 1, 1);
+    for(auto _ : state) {
+        splittercell::distribution copy(d);
+        benchmark::DoNotOptimize(&copy);
+    }
+}
+BENCHMARK(BM_Copy)->ArgsProduct({{4, 64, 256}, {4, 12}});
+
+/* Arguments: flocks, chain depth, threads. A persuasion dialogue: each move refines the beliefs of the user in a
+ * couple of arguments (the system's argument and a counter-argument) and the system then reads every belief
+ * to choose its next move. Moves are drawn from a fixed seed, so every run plays the same dialogue. */
+static void BM_Dialogue(benchmark::State &state) {
+    unsigned int flocks = state.range(0), size = 6;
+    auto d = chain(flocks, size, state.range(1), state.range(2));
+    std::mt19937 moves(42);
+    std::uniform_int_distribution<unsigned int> argument(0, flocks * size - 1);
+    std::uniform_real_distribution<double> strength(0.05, 0.5);
+    for(auto _ : state) {
+        d.refine(argument(moves), true, strength(moves));
+        d.refine(argument(moves), false, strength(moves));
+        benchmark::DoNotOptimize(d.beliefs_all());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Dialogue)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{4, 12, 32}, {1, 3}});});
+
+/* Arguments: flocks, observed or refined with coefficient 1, threads. The user has committed to half of the arguments
+ * of every flock, reading every belief after each commitment, and the dialogue goes on with the arguments linking
+ * the flocks. Observed arguments are out of the tables, refined ones leave half of them impossible. */
+static void BM_Committed(benchmark::State &state) {
+    unsigned int flocks = state.range(0), size = 6, move = 0;
+    auto d = chain(flocks, size, 4, state.range(2));
+    for(unsigned int f = 0; f < flocks; f++)
+        for(unsigned int a = size / 2; a < size; a++) {
+            if(state.range(1))
+                d.observe(f * size + a, a % 2);
+            else
+                d.refine(f * size + a, a % 2, 1.0);
+            d.beliefs_all();
+        }
+    for(auto _ : state) {
+        d.refine(move % flocks * size, move / flocks % 2, 0.1);
+        move++;
+        benchmark::DoNotOptimize(d.beliefs_all());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Committed)->Apply([](benchmark::internal::Benchmark *b) {threads_and(b, {{12, 32}, {0, 1}});});
@@ -0,0 +1,57 @@
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "kernels.h"
+
+using splittercell::kernels::isa;
+
+/* The branching kernel flock::refine used before the strided one, kept as a reference point */
+static void legacy_refine(std::vector<double> &distribution, unsigned int index, bool positive, double coefficient) {
+    for (unsigned int i = 0; i < distribution.size(); i++) {
+        if((bool)(i & (1U << index)) == positive) {
+            unsigned int opposite = i ^ (1U << index);
+            double opposite_val = distribution[opposite];
+            distribution[opposite] *= (1U - coefficient);
+            distribution[i] += coefficient * opposite_val;
+        }
+    }
+}
+
+/* Arguments: flock size, refined argument index */
+static void BM_RefineLegacy(benchmark::State &state) {
+    std::vector<double> distribution(1U << state.range(0), 1.0 / (1U << state.range(0)));
+    for(auto _ : state) {
+        legacy_refine(distribution, state.range(1), true, 0.5);
+        benchmark::DoNotOptimize(distribution.data());
+    }
+    state.SetBytesProcessed(state.iterations() * distribution.size() * sizeof(double));
+}
+
+static void refine_with(benchmark::State &state, isa level) {
+    if(splittercell::kernels::detected_isa() < level) {
+        state.SkipWithError("Instruction set not supported by this CPU");
+        return;
+    }
+    splittercell::kernels::set_isa(level);
+    std::vector<double> distribution(1U << state.range(0), 1.0 / (1U << state.range(0)));
+    for(auto _ : state) {
+        splittercell::kernels::refine(distribution.data(), distribution.size(), state.range(1), true, 0.5);
+        benchmark::DoNotOptimize(distribution.data());
+    }
+    state.SetBytesProcessed(state.iterations() * distribution.size() * sizeof(double));
+    splittercell::kernels::set_isa(splittercell::kernels::detected_isa());
+}
+
+static void BM_RefineScalar(benchmark::State &state) {refine_with(state, isa::scalar);}
+static void BM_RefineSSE2(benchmark::State &state)   {refine_with(state, isa::sse2);}
+static void BM_RefineAVX2(benchmark::State &state)   {refine_with(state, isa::avx2);}
+
+static void refine_sizes(benchmark::internal::Benchmark *b) {
+    for(int size = 16; size <= 24; size += 2)
+        for(int index : {0, 3, size - 1})
+            b->Args({size, index});
+}
+
+BENCHMARK(BM_RefineLegacy)->Apply(refine_sizes);
+BENCHMARK(BM_RefineScalar)->Apply(refine_sizes);
+BENCHMARK(BM_RefineSSE2)->Apply(refine_sizes);
+BENCHMARK(BM_RefineAVX2)->Apply(refine_sizes);
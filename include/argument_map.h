@@ -0,0 +1,101 @@
+#ifndef SPLITTERCELL_ARGUMENT_MAP_H
+#define SPLITTERCELL_ARGUMENT_MAP_H
+
+#include <vector>
+#include <unordered_map>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace splittercell {
+    /* Argument id -> dense slot. As long as the ids are small next to their number (the usual case) a lookup is a
+     * single load from a flat vector. A few sparser ids (the arguments of a small flock) are scanned in a short list,
+     * more of them fall back to a hash map. */
+    class argument_map {
+    public:
+        static const unsigned int npos = std::numeric_limits<unsigned int>::max();
+
+        /* Constructors */
+        argument_map() : _count(0), _dense(true) {}
+        /* Accessors */
+        unsigned int size() const {return _count;}
+        bool dense() const {return _dense;}
+        unsigned int find(unsigned int argument) const {
+            if(_dense)
+                return (argument < _slots.size()) ? _slots[argument] : npos;
+            if(_count <= max_listed) {
+                for(auto &l : _listed)
+                    if(l.first == argument)
+                        return l.second;
+                return npos;
+            }
+            auto it = _sparse.find(argument);
+            return (it == _sparse.end()) ? npos : it->second;
+        }
+        bool contains(unsigned int argument) const {return find(argument) != npos;}
+        unsigned int at(unsigned int argument) const {
+            unsigned int slot = find(argument);
+            if(slot == npos)
+                throw std::out_of_range("Unknown argument " + std::to_string(argument) + ".");
+            return slot;
+        }
+        /* Modifiers */
+        void insert(unsigned int argument, unsigned int slot) {
+            if(!contains(argument))
+                _count++;
+            if(_dense && argument >= max_spread * _count + 64) { //Too sparse for a flat vector
+                for(unsigned int a = 0; a < _slots.size(); a++)
+                    if(_slots[a] != npos)
+                        _listed.emplace_back(a, _slots[a]);
+                _slots.clear();
+                _dense = false;
+            }
+            if(!_dense && _count > max_listed && !_listed.empty()) { //Too many to scan
+                for(auto &l : _listed)
+                    _sparse[l.first] = l.second;
+                _listed.clear();
+            }
+            if(!_dense) {
+                if(_count > max_listed) {
+                    _sparse[argument] = slot;
+                    return;
+                }
+                for(auto &l : _listed)
+                    if(l.first == argument) {
+                        l.second = slot;
+                        return;
+                    }
+                _listed.emplace_back(argument, slot);
+                return;
+            }
+            if(argument >= _slots.size())
+                _slots.resize(argument + 1, (unsigned int)npos);
+            _slots[argument] = slot;
+        }
+        /* Room for count ids up to largest, so that inserting them does not reallocate */
+        void reserve(unsigned int count, unsigned int largest) {
+            if(_dense && largest < max_spread * count + 64)
+                _slots.reserve(largest + 1);
+            else if(count <= max_listed)
+                _listed.reserve(count);
+        }
+        void clear() {
+            _slots.clear();
+            _listed.clear();
+            _sparse.clear();
+            _count = 0;
+            _dense = true;
+        }
+
+    private:
+        static const unsigned int max_spread = 4, max_listed = 8;
+        std::vector<unsigned int> _slots;
+        std::vector<std::pair<unsigned int, unsigned int>> _listed;
+        std::unordered_map<unsigned int, unsigned int> _sparse;
+        unsigned int _count;
+        bool _dense;
+    };
+}
+
+#endif //SPLITTERCELL_ARGUMENT_MAP_H
@@ -3,55 +3,187 @@
 
 #include <vector>
 #include <memory>
+#include <atomic>
 #include <unordered_map>
 #include <set>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "argument_map.h"
 #include "flock.h"
+#include "factor_cache.h"
+#include "stats.h"
+#include "sampling.h"
 
 namespace splittercell {
-    class distribution {
+    template<typename S> class basic_snapshot;
+
+    /* S is the scalar the flock tables are stored as (see basic_flock), beliefs are always plain probabilities */
+    template<typename S>
+    class basic_distribution {
     public:
+        typedef basic_flock<S> flock_type;
+        typedef typename flock_type::value_type value_type;
+
         /* Constructors */
-        distribution(std::vector<std::unique_ptr<flock>> &flocks, bool mt = true);
-        distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial = {}, bool mt = true);
-        distribution(const distribution &other);
+        basic_distribution(std::vector<std::unique_ptr<flock_type>> &flocks, std::shared_ptr<executor> exec = nullptr);
+        basic_distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial = {},
+                           std::shared_ptr<executor> exec = nullptr);
+        /* mt = false runs everything on the calling thread, as disable_mt() */
+        basic_distribution(std::vector<std::unique_ptr<flock_type>> &flocks, bool mt);
+        basic_distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial, bool mt);
+        basic_distribution(const basic_distribution &other); //Snapshot: flocks are shared until one side modifies them
         /* Accessors */
         std::unordered_map<unsigned int, double> operator[](const std::vector<unsigned int> &arguments);
-        flock* get_flock(unsigned int f) const {return _flocks[f].get();}
-        void set_probabilities(unsigned int f, const std::vector<double> &probabilities) {
-            _flocks[f]->set_probabilities(probabilities);
-            for(auto arg : _flocks[f]->conditioned())
-                _cache_is_valid[arg] = false;
-        }
-        void disable_mt() {_mt = false;}
-        /* Modifiers */
-        void refine(unsigned int argument, bool positive, double coefficient) {
-            _flocks[_mapping[argument]]->refine(argument, positive, coefficient);
-            _cache_is_valid[argument] = false;
+        std::unordered_map<unsigned int, double> beliefs_all();
+        /* Beliefs in the targets after each candidate refinement, as if it alone had been applied, without changing the
+         * distribution: only the refined flock is copied, beliefs that do not depend on it are shared between the
+         * candidates and so are the factors of the other flocks (through the factor cache). Candidates run in parallel. */
+        std::vector<std::unordered_map<unsigned int, double>> what_if(const std::vector<update> &candidates, const std::vector<unsigned int> &targets) const;
+        const flock_type* get_flock(unsigned int f) const {return _flocks[f].get();}
+        /* Forward sampling of the flocks the arguments depend on, in parallel chunks with one random stream each. For
+         * conditioning closures too large to combine; nothing is cached. Throws std::invalid_argument without a limit. */
+        approximate_beliefs approximate(const std::vector<unsigned int> &arguments, const sampling_budget &budget = sampling_budget()) const;
+        void set_probabilities(unsigned int f, const std::vector<value_type> &probabilities);
+        bool dense_ids() const {return _slots.dense();}
+        /* Parallelism: the process-wide thread pool unless told otherwise. set_threads() only caps how many of its
+         * workers the loops of this distribution use, no thread is started for it. */
+        void disable_mt() {_executor = std::make_shared<sequential_executor>();}
+        void set_threads(unsigned int threads) {
+            if(threads <= 1)
+                disable_mt();
+            else
+                _executor = std::make_shared<capped_executor>(threads);
         }
+        void set_executor(std::shared_ptr<executor> exec) {_executor = std::move(exec);}
+        /* Intermediate factors kept between queries, keyed by the versions of the flocks they come from. Copies of the
+         * distribution share it until one of them sets its budget. */
+        const basic_factor_cache<S> &cache() const {return *_factors;}
+        void set_cache_budget(std::size_t bytes);
+        /* Tables built by queries come from and go back to it, so that repeated queries reuse the same blocks. Each
+         * distribution has its own, copies start with an empty one. */
+        const storage::workspace &workspace() const {return *_workspace;}
+        /* Modifiers. A refinement keeps the marginals of the other arguments of the flock (it only moves mass inside
+         * the pairs of models split by the refined argument) and changes the belief in the refined one by the same
+         * closed form in every configuration of the conditioning, so both stay cached exactly. Only the beliefs that
+         * depend on it, in the flocks conditioned on it and so on, have to be computed again. */
+        void refine(unsigned int argument, bool positive, double coefficient);
+        /* All updates of a flock in one pass and one copy-on-write of it (see basic_flock::refine_batch). Every
+         * argument is checked before anything changes. */
+        void refine_batch(const std::vector<update> &updates);
+        /* Hard evidence, with the meaning of refine(argument, value, 1.0): the argument is then sliced out of its flock
+         * and of the flocks conditioned on it (see basic_flock::observe), so their tables halve and later queries get
+         * cheaper. It is not the posterior given the argument: nothing is pushed up to the flocks it is conditioned on,
+         * and the rest of its flock keeps its beliefs, as with a refinement. Only the beliefs downstream of it change.
+         * Its belief stays cached as 1 or 0, it can no longer be refined. */
+        void observe(unsigned int argument, bool value);
+        /* Only the cached belief, the flocks are left as they are */
         void fast_refine(unsigned int argument, bool positive, double coefficient) {
-          if(!_cache_is_valid[argument])
+          auto slot = _slots.at(argument);
+          if(!_cache_is_valid[slot])
               throw std::invalid_argument("Cannot fast update " + std::to_string(argument) + " cache is invalid.");
-          if(positive)
-              _belief_cache[argument] += coefficient * (1 - _belief_cache[argument]);
-          else
-              _belief_cache[argument] *= (1 - coefficient);
+          refine_belief(slot, positive, coefficient);
         }
-        std::unique_ptr<flock> marginalize(unsigned int f, const std::vector<unsigned int> &args_to_keep) {
-            return _flocks[f]->marginalize(args_to_keep);
+        std::unique_ptr<flock_type> marginalize(unsigned int f, const std::vector<unsigned int> &args_to_keep) {
+            return _flocks[f]->marginalize(args_to_keep, _executor.get());
         }
 
+        /* Concurrent readers: publish() makes the current state available to any number of threads through published(),
+         * which they call while a single writer thread keeps modifying the distribution. Publishing copies the topology
+         * and the belief cache, not the flocks (see the copy constructor), but every flock is copied on its next change
+         * after that. published() is null until the first publish(). */
+        void publish();
+        std::shared_ptr<const basic_snapshot<S>> published() const {return std::atomic_load(&_published);}
+
+        /* Checkpoints: rollback() restores the state of the matching checkpoint(), commit() keeps the changes.
+         * Only the flocks modified in between are kept aside, so both are cheap whatever the size of the model. */
+        std::size_t checkpoint();
+        void rollback();
+        void commit();
+        std::size_t checkpoints() const {return _checkpoints.size();}
+
+        /* Binary snapshot of the topology, tables and belief cache (see serialization.h). The writer streams the tables
+         * as they are, save a copy of a live distribution to checkpoint it while it keeps going. load() maps the file
+         * and uses the tables in place, changes made to them afterwards stay in memory. Both throw std::runtime_error. */
+        void save(std::ostream &out) const;
+        void save(const std::string &path) const;
+        static basic_distribution load(const std::string &path, std::shared_ptr<executor> exec = nullptr);
+
         std::string to_str() const;
 
     private:
-        std::vector<std::unique_ptr<flock>> _flocks;
-        std::unordered_map<unsigned int, unsigned int> _mapping;
-        std::unordered_map<unsigned int, double> _belief_cache;
-        std::unordered_map<unsigned int, bool> _cache_is_valid;
-        bool _mt;
+        /* A flock used in place of one of the distribution's, under its own signature (see what_if) */
+        struct flock_override {
+            unsigned int flock;
+            const flock_type *replacement;
+            std::string signature;
+        };
+        struct saved_state {
+            std::vector<std::pair<unsigned int, std::shared_ptr<flock_type>>> flocks; //As they were before their first change
+            std::vector<std::uint64_t> versions;
+            std::vector<double> belief_cache;
+            std::vector<bool> cache_is_valid;
+            std::vector<unsigned int> flock_of; //Observations take arguments out of their flocks
+        };
+
+        std::vector<std::shared_ptr<flock_type>> _flocks; //Shared between snapshots, copied on the first write
+        std::vector<saved_state> _checkpoints;
+        /* Arguments are translated once to dense slots, everything per argument is a flat vector indexed by slot */
+        argument_map _slots;
+        std::vector<unsigned int> _arguments, _flock_of;
+        std::vector<std::vector<unsigned int>> _dependents; //Per slot, the flocks conditioned on the argument
+        std::vector<double> _belief_cache;
+        std::vector<bool> _cache_is_valid;
+        std::shared_ptr<executor> _executor;
+        std::vector<std::uint64_t> _versions; //Bumped on every change of the flock, unique across distributions
+        std::vector<bool> _published_flocks; //Held by a published snapshot since their last copy, copied on their next change
+        /* Shared with copies: keys name unique flock versions, so a factor is the same whoever computed it. Copied
+         * before its budget changes. */
+        std::shared_ptr<basic_factor_cache<S>> _factors;
+        std::shared_ptr<storage::workspace> _workspace;
+        std::shared_ptr<const basic_snapshot<S>> _published; //Only accessed atomically, not copied
+
+        friend class basic_snapshot<S>;
 
+        static std::uint64_t next_version();
+        flock_type *modify(unsigned int f);
+        unsigned int compute_beliefs(const std::set<unsigned int> &arguments, std::unordered_map<unsigned int, double> &beliefs, executor *exec,
+                                     const flock_override *override = nullptr) const;
         void find_conditioning(unsigned int argument, std::set<unsigned int> &conditioning) const;
-        std::unique_ptr<flock> find_and_combine(const std::vector<unsigned int> &arguments) const;
+        std::shared_ptr<const flock_type> find_and_combine(const std::vector<unsigned int> &arguments, unsigned int &largest, executor *exec,
+                                                           const flock_override *override) const;
+        unsigned int add_argument(unsigned int argument, unsigned int f, bool valid, double belief);
+        void link_flocks();
+        static double refined_belief(double belief, bool positive, double coefficient);
+        void refine_belief(unsigned int slot, bool positive, double coefficient) {_belief_cache[slot] = refined_belief(_belief_cache[slot], positive, coefficient);}
+        std::vector<bool> dependents(std::vector<unsigned int> changed) const;
+        void invalidate_dependents(const std::vector<unsigned int> &changed);
     };
+
+    /* A distribution as it was published, queried from any number of threads at once. Beliefs it does not hold yet are
+     * computed on the calling thread, without the thread pool (the readers are the parallelism), and kept for the
+     * other readers; so are the intermediate factors. */
+    template<typename S>
+    class basic_snapshot {
+    public:
+        /* Constructors */
+        basic_snapshot(const basic_distribution<S> &d, std::uint64_t generation);
+        /* Accessors */
+        std::unordered_map<unsigned int, double> operator[](const std::vector<unsigned int> &arguments) const;
+        std::uint64_t generation() const {return _generation;} //Number of publications of the distribution up to this one
+
+    private:
+        basic_distribution<S> _distribution;
+        mutable std::vector<std::atomic<double>> _beliefs; //Per slot, NaN until known
+        std::uint64_t _generation;
+    };
+
+    typedef basic_distribution<double> distribution;
+    typedef basic_distribution<float> float_distribution;
+    typedef basic_distribution<log_space<double>> log_distribution;
+    typedef basic_snapshot<double> distribution_snapshot;
+    typedef basic_snapshot<float> float_distribution_snapshot;
+    typedef basic_snapshot<log_space<double>> log_distribution_snapshot;
 }
 
 #endif //SPLITTERCELL_DISTRIBUTION_H
@@ -0,0 +1,74 @@
+#ifndef SPLITTERCELL_DISTRIBUTION_BATCH_H
+#define SPLITTERCELL_DISTRIBUTION_BATCH_H
+
+#include <vector>
+#include <memory>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include "argument_map.h"
+#include "flock.h"
+#include "thread_pool.h"
+
+namespace splittercell {
+    /* Many sessions sharing one flock structure with their own probabilities. Every table is stored model-major:
+     * the values of all the sessions for a model are contiguous, so each operation is a loop over models whose
+     * body is a vectorizable loop over sessions. Sessions are split across threads, which never share a value.
+     * Elimination plans (order, index mappings) depend only on the structure and are built once per query; the least
+     * recently used ones are dropped past plan_limit() of them. */
+    class distribution_batch {
+    public:
+        /* Constructors: every session starts with the tables of the given flocks */
+        distribution_batch(const std::vector<std::unique_ptr<flock>> &flocks, unsigned int sessions, std::shared_ptr<executor> exec = nullptr);
+        /* Accessors */
+        unsigned int sessions() const {return _sessions;}
+        unsigned int flocks() const {return _layouts.size();}
+        std::vector<double> probabilities(unsigned int session, unsigned int f) const;
+        /* beliefs[argument][session] */
+        std::unordered_map<unsigned int, std::vector<double>> operator[](const std::vector<unsigned int> &arguments) const;
+        void set_probabilities(unsigned int session, unsigned int f, const std::vector<double> &probabilities);
+        void set_executor(std::shared_ptr<executor> exec) {_executor = std::move(exec);}
+        std::size_t plan_limit() const {return _plan_limit;}
+        std::size_t cached_plans() const {std::lock_guard<std::mutex> lock(_plans_mutex); return _plans.size();}
+        void set_plan_limit(std::size_t plans);
+        /* Modifiers */
+        void refine(unsigned int argument, bool positive, double coefficient);
+        void refine(unsigned int argument, bool positive, const std::vector<double> &coefficients); //One per session
+
+        static const std::size_t default_plan_limit = 64;
+
+    private:
+        struct layout {
+            std::vector<unsigned int> conditioned, conditioning;
+            unsigned int size() const {return conditioned.size() + conditioning.size();}
+            unsigned int position(unsigned int argument) const;
+        };
+        struct step {
+            unsigned int first, second, out; //Factor ids, second is unused by sums
+            std::vector<std::size_t> first_index, second_index; //Product: models of first and second for each model of out
+            std::vector<std::size_t> destination; //Sum: model of out for each model of first
+        };
+        struct plan {
+            std::vector<layout> factors; //The flocks first, then the intermediate factors
+            std::vector<step> steps;
+            unsigned int result;
+        };
+
+        unsigned int _sessions;
+        std::vector<layout> _layouts;
+        std::vector<std::vector<double>> _tables;
+        argument_map _flock_of;
+        std::shared_ptr<executor> _executor;
+        typedef std::list<std::pair<std::vector<unsigned int>, std::shared_ptr<const plan>>> lru;
+        mutable lru _plans; //Most recently used first
+        mutable std::map<std::vector<unsigned int>, lru::iterator> _plan_index;
+        std::size_t _plan_limit;
+        mutable std::mutex _plans_mutex;
+
+        std::shared_ptr<const plan> make_plan(const std::vector<unsigned int> &arguments) const;
+        void for_sessions(const std::function<void(std::size_t, std::size_t)> &body) const;
+    };
+}
+
+#endif //SPLITTERCELL_DISTRIBUTION_BATCH_H
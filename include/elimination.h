@@ -0,0 +1,50 @@
+#ifndef SPLITTERCELL_ELIMINATION_H
+#define SPLITTERCELL_ELIMINATION_H
+
+#include <vector>
+#include <memory>
+#include <set>
+#include <string>
+#include "flock.h"
+#include "factor_cache.h"
+
+namespace splittercell {
+    /* Variable elimination over a set of flocks: arguments are summed out as soon as no remaining flock needs them,
+     * in a greedy min-fill order, so the largest table built is bounded by the induced width of the elimination
+     * order rather than by the number of arguments in the whole set. */
+    template<typename S>
+    class basic_elimination {
+    public:
+        typedef basic_flock<S> flock_type;
+
+        /* Constructors */
+        basic_elimination(const std::vector<const flock_type*> &flocks, executor *exec = nullptr);
+        /* With one signature per flock (unique to its contents), intermediate factors are reused through the cache */
+        basic_elimination(const std::vector<const flock_type*> &flocks, const std::vector<std::string> &signatures,
+                          basic_factor_cache<S> *cache, executor *exec = nullptr);
+        /* Accessors */
+        unsigned int peak() const {return _peak;} //Most arguments in a single table built so far
+        /* Joint distribution of the arguments, which must be conditioned in one of the flocks */
+        std::shared_ptr<const flock_type> joint(const std::vector<unsigned int> &arguments);
+
+        /* Greedy min-fill (ties broken by min-degree) order in which to eliminate every argument not kept */
+        static std::vector<unsigned int> order(const std::vector<std::vector<unsigned int>> &scopes, const std::set<unsigned int> &keep);
+
+    private:
+        struct factor {
+            std::shared_ptr<const flock_type> table;
+            std::string signature;
+        };
+        std::vector<factor> _factors;
+        basic_factor_cache<S> *_cache;
+        executor *_exec;
+        unsigned int _peak;
+
+        std::string signature(std::vector<factor> &factors, const std::string &operation) const;
+        std::shared_ptr<const flock_type> multiply(std::vector<factor> &factors);
+    };
+
+    typedef basic_elimination<double> elimination;
+}
+
+#endif //SPLITTERCELL_ELIMINATION_H
@@ -0,0 +1,57 @@
+#ifndef SPLITTERCELL_FACTOR_CACHE_H
+#define SPLITTERCELL_FACTOR_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include "flock.h"
+
+namespace splittercell {
+    /* Least recently used store of intermediate flocks (products and eliminated factors) under a memory budget.
+     * Keys spell out the flocks and versions a factor was computed from, so a refinement never needs to purge
+     * anything: the factors it made stale are simply not asked for anymore and age out. */
+    template<typename S>
+    class basic_factor_cache {
+    public:
+        typedef basic_flock<S> flock_type;
+
+        static const std::size_t default_budget = std::size_t(256) << 20;
+
+        /* Constructors */
+        explicit basic_factor_cache(std::size_t budget = default_budget) : _budget(budget), _bytes(0), _hits(0), _misses(0) {}
+        basic_factor_cache(const basic_factor_cache &other);
+        /* Accessors */
+        std::size_t budget() const {return _budget;}
+        std::size_t bytes() const {std::lock_guard<std::mutex> lock(_mutex); return _bytes;}
+        std::size_t size() const {std::lock_guard<std::mutex> lock(_mutex); return _entries.size();}
+        std::size_t hits() const {std::lock_guard<std::mutex> lock(_mutex); return _hits;}
+        std::size_t misses() const {std::lock_guard<std::mutex> lock(_mutex); return _misses;}
+        std::shared_ptr<const flock_type> find(const std::string &key);
+        /* Modifiers */
+        void insert(const std::string &key, std::shared_ptr<const flock_type> f);
+        void set_budget(std::size_t budget);
+        void clear();
+
+        static std::size_t footprint(const flock_type &f) {return f.table_bytes() + sizeof(flock_type);}
+
+    private:
+        struct entry {
+            std::string key;
+            std::shared_ptr<const flock_type> factor;
+            std::size_t bytes; //Footprint when inserted, the factor can grow later (see basic_flock::table_bytes)
+        };
+        typedef std::list<entry> lru;
+        lru _entries; //Most recently used first
+        std::unordered_map<std::string, typename lru::iterator> _index;
+        std::size_t _budget, _bytes, _hits, _misses;
+        mutable std::mutex _mutex;
+
+        void evict();
+    };
+
+    typedef basic_factor_cache<double> factor_cache;
+}
+
+#endif //SPLITTERCELL_FACTOR_CACHE_H
@@ -5,44 +5,125 @@
 #include <memory>
 #include <functional>
 #include <map>
-#include <unordered_map>
 #include <utility>
+#include <mutex>
+#include <limits>
+#include <array>
+#include "argument_map.h"
+#include "scalar_traits.h"
+#include "table_storage.h"
+#include "gather_plan.h"
+#include "thread_pool.h"
 
 namespace splittercell {
-    class flock {
+    /* Up to 2^62 models, tables past what the RAM holds need a file backed storage policy (see table_storage.h) */
+    const unsigned int max_flock_arguments = std::numeric_limits<std::size_t>::digits - 2;
+
+    /* A flock of at least min_sparse_bits arguments only stores its possible models once at most 1/sparse_fill of them
+     * are, and goes back to a full table past 1/dense_fill of them */
+    const unsigned int min_sparse_bits = 10, sparse_fill = 16, dense_fill = 4;
+
+    /* One refinement of a batch (see refine_batch) */
+    struct update {
+        unsigned int argument;
+        bool positive;
+        double coefficient;
+    };
+
+    /* S is the scalar the table is stored as: double (the default), float, or log_space<double>. Tables given to and
+     * returned by a flock are in that representation, marginals are always plain probabilities.
+     * Tables become sparse (sorted possible models and their values) where impossible models are made: given tables,
+     * refinements that empty one side of an argument, products and marginals of sparse flocks. Refine, marginalize and
+     * combine then only walk the possible models. distribution() builds the full table on demand and keeps it until the
+     * next change, for_each_model() walks it without building it. */
+    template<typename S>
+    class basic_flock {
     public:
+        typedef scalar_traits<S> traits;
+        typedef typename traits::value_type value_type;
+
         /* Constructors */
-        flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond = {}, const std::vector<double> &distribution = {});
-        flock(const flock &other);
+        basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond = {}, const std::vector<value_type> &distribution = {});
+        basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, table<value_type> &&distribution, bool uniform);
+        /* Sparse table: the possible models in increasing order and their values, every other model is impossible */
+        basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, std::vector<std::size_t> models,
+                    std::vector<value_type> values);
+        basic_flock(const basic_flock &other);
         /* Accessors */
         unsigned int size() const {return _size;}
-        const std::vector<double> &distribution() const {return _distribution;}
-        void set_probabilities(const std::vector<double> &probabilities) {_distribution = probabilities; _uniform = false;}
+        const table<value_type> &distribution() const;
+        void set_probabilities(const std::vector<value_type> &probabilities);
         const std::vector<unsigned int> &conditioned() const {return _conditioned;}
         const std::vector<unsigned int> &conditioning() const {return _conditioning;}
         bool uniform() const {return _uniform;}
-        /* Modifiers*/
-        void refine(unsigned int argument, bool positive, double coefficient);
-        std::unique_ptr<flock> marginalize(const std::vector<unsigned int> &args_to_keep) const;
-        void marginalize_self(const std::vector<unsigned int> &args_to_keep);
-        std::unique_ptr<flock> combine(const flock * const f, bool mt = true) const;
+        bool sparse() const {return _sparse;}
+        std::size_t table_bytes() const; //Full table built by distribution() included
+        /* f(model, value) for every model in increasing order, impossible ones included */
+        template<typename F>
+        void for_each_model(F &&f) const {
+            if(!_sparse) {
+                for(std::size_t i = 0; i < _distribution.size(); i++)
+                    f(i, _distribution[i]);
+                return;
+            }
+            std::size_t k = 0;
+            for(std::size_t i = 0; i < (std::size_t(1) << _size); i++)
+                f(i, (k < _models.size() && _models[k] == i) ? _values[k++] : traits::zero());
+        }
+        unsigned int index(unsigned int argument) const {return _mapping.at(argument);}
+        std::vector<double> all_marginals(executor *exec = nullptr) const;
+        /* The models that are not impossible, in increasing order, and their probabilities */
+        void possible_models(std::vector<std::size_t> &models, std::vector<double> &probabilities) const;
+        /* Modifiers (a null executor means the process-wide thread pool, small flocks always run inline) */
+        void refine(unsigned int argument, bool positive, double coefficient, executor *exec = nullptr);
+        /* Same as refining in order, up to rounding. The updates of an argument are composed into a single operator on
+         * the pairs of models it splits, operators of different arguments commute and are all applied in one pass over
+         * cache sized tiles (one more pass per max_fused_bits arguments whose pairs are further apart than a tile). */
+        void refine_batch(const std::vector<update> &updates, executor *exec = nullptr);
+        /* Drops the argument as if it had been refined to the value with a coefficient of 1. A conditioned one is summed
+         * out, so the rest of the flock keeps its marginals in every configuration of the conditioning (it is not
+         * conditioned on the value), and a flock left without conditioned arguments becomes empty. For a conditioning
+         * one only the half of the table where it has the value is kept. */
+        void observe(unsigned int argument, bool value);
+        std::unique_ptr<basic_flock> marginalize(const std::vector<unsigned int> &args_to_keep, executor *exec = nullptr) const;
+        void marginalize_self(const std::vector<unsigned int> &args_to_keep, executor *exec = nullptr);
+        std::unique_ptr<basic_flock> combine(const basic_flock * const f, bool mt = true) const;
+        std::unique_ptr<basic_flock> combine(const basic_flock * const f, executor *exec) const;
 
         std::string to_str() const;
-        bool operator==(const flock &other) const {return (_conditioned == other._conditioned) &&
-                    (_conditioning == other._conditioning) && (_distribution == other._distribution); }
+        bool operator==(const basic_flock &other) const;
 
     private:
         std::vector<unsigned int> _conditioned, _conditioning;
-        std::vector<double> _distribution;
-        std::unordered_map<unsigned int, unsigned int> _mapping;
+        mutable table<value_type> _distribution; //When sparse, only built by distribution()
+        std::vector<std::size_t> _models; //When sparse: the possible models, sorted, and their values
+        std::vector<value_type> _values;
+        argument_map _mapping;
         unsigned int _size;
-        bool _uniform;
+        bool _uniform, _sparse;
+        mutable std::mutex _table_mutex;
+        mutable std::map<std::vector<unsigned int>, std::shared_ptr<const gather_plan>> _plans;
+        mutable std::mutex _plans_mutex;
+        static const unsigned int max_cached_plans = 16;
 
         void map_arguments();
-        std::vector<double> marginalized_distribution(const std::vector<unsigned int> &args_to_keep) const;
-        void mt_combine(flock * const combinedflock, const flock * const f, const std::vector<std::pair<unsigned int, unsigned int>> &splitindex, unsigned int startindex, unsigned int endindex) const;
-        void perform_mt(unsigned int bound, std::function<void(unsigned int, unsigned int)> t) const;
+        void adapt();
+        void make_sparse();
+        void make_dense();
+        void sparse_apply(unsigned int index, const std::array<value_type, 4> &m);
+        void sparse_marginalized(const std::vector<unsigned int> &args_to_keep, std::vector<std::size_t> &models, std::vector<value_type> &values) const;
+        std::unique_ptr<basic_flock> sparse_combine(const basic_flock * const f, const std::vector<unsigned int> &conditioned,
+                                                    const std::vector<unsigned int> &conditioning) const;
+        table<value_type> marginalized_distribution(const std::vector<unsigned int> &args_to_keep, executor *exec) const;
+        unsigned int destinations(const std::vector<unsigned int> &args_to_keep, unsigned int *destination) const;
+        std::shared_ptr<const gather_plan> plan(const std::vector<unsigned int> &args_to_keep) const;
+        void mt_combine(basic_flock * const combinedflock, const basic_flock * const f, const product_plan &plan, std::size_t startblock, std::size_t endblock) const;
+        void perform_mt(executor *exec, std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &t) const;
     };
+
+    typedef basic_flock<double> flock;
+    typedef basic_flock<float> float_flock;
+    typedef basic_flock<log_space<double>> log_flock;
 }
 
 #endif //SPLITTERCELL_FLOCK_H
@@ -0,0 +1,74 @@
+#ifndef SPLITTERCELL_GATHER_PLAN_H
+#define SPLITTERCELL_GATHER_PLAN_H
+
+#include <vector>
+#include <array>
+#include <limits>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "scalar_traits.h"
+
+namespace splittercell {
+    const unsigned int min_block_bits = 3; //Shorter contiguous blocks cost more in calls than they save in gathers
+
+    /* Precomputed mapping from the models of a table to the models of a table over a subset of its bits,
+     * built once per (source layout, kept bits) and reused for every reduction with the same layout. */
+    class gather_plan {
+    public:
+        static const unsigned int dropped = std::numeric_limits<unsigned int>::max();
+
+        /* destination[b] is the bit of source bit b in the gathered index, or dropped */
+        gather_plan(const std::vector<unsigned int> &destination);
+        /* Accessors */
+        unsigned int source_bits() const {return _destination.size();}
+        unsigned int destination_bits() const {return _destination_bits;}
+        std::size_t map(std::size_t index) const {
+            std::size_t end = 0;
+            for(unsigned int t = 0; t < _tables.size(); t++, index >>= 8)
+                end |= _tables[t][index & 0xFFU];
+            return end;
+        }
+        /* dst (2^destination_bits, zeroed by the caller) += src (2^source_bits) summed over the dropped bits.
+         * S is the scalar of the tables (see scalar_traits), instantiated for those of the flocks. */
+        template<typename S = double>
+        void marginalize(const typename scalar_traits<S>::value_type *src, typename scalar_traits<S>::value_type *dst) const;
+        /* Same for the source models [begin, end), which are multiples of block() */
+        template<typename S = double>
+        void marginalize(const typename scalar_traits<S>::value_type *src, typename scalar_traits<S>::value_type *dst,
+                         std::size_t begin, std::size_t end) const;
+        std::size_t block() const {return std::size_t(1) << std::max(_low_dropped, _low_identity);}
+
+    private:
+        std::vector<unsigned int> _destination;
+        std::vector<std::array<std::size_t, 256>> _tables; //Partial gathered index of each byte of a source index
+        unsigned int _destination_bits, _low_dropped, _low_identity;
+        std::uint64_t _pext_mask;
+        bool _ordered; //Kept bits keep their relative order and are packed, so the gather is a single PEXT
+    };
+
+    /* Index generation for the product of two tables. The low bits of a product index are looked up in two small
+     * tables and the high bits are gathered once per block. When the low bits only come from one factor, a block
+     * is a contiguous run of that factor times a single value of the other one. */
+    class product_plan {
+    public:
+        /* first[j] (second[j]) is the bit of product bit j in the first (second) factor, or gather_plan::dropped */
+        product_plan(const std::vector<unsigned int> &first, const std::vector<unsigned int> &second);
+        /* Accessors */
+        std::size_t blocks() const {return std::size_t(1) << (_bits - _block_bits);}
+        /* out = a * b for the product models of blocks [begin, end) */
+        template<typename S = double>
+        void multiply(const typename scalar_traits<S>::value_type *a, const typename scalar_traits<S>::value_type *b,
+                      typename scalar_traits<S>::value_type *out, std::size_t begin, std::size_t end) const;
+
+    private:
+        enum class layout {first_runs, second_runs, gathered};
+        gather_plan _first, _second;
+        std::vector<std::size_t> _low_first, _low_second;
+        unsigned int _bits, _block_bits;
+        layout _layout;
+        static const unsigned int max_block_bits = 12;
+    };
+}
+
+#endif //SPLITTERCELL_GATHER_PLAN_H
@@ -0,0 +1,42 @@
+#ifndef SPLITTERCELL_KERNELS_H
+#define SPLITTERCELL_KERNELS_H
+
+#include <cstddef>
+
+namespace splittercell {
+    namespace kernels {
+        /* Instruction sets the kernels can be dispatched to, the best supported one is picked at startup */
+        enum class isa {scalar, sse2, avx2};
+
+        isa detected_isa();
+        isa active_isa();
+        void set_isa(isa level); //Clamped to what the CPU supports, mostly useful for benchmarks and tests
+        const char *isa_name(isa level);
+        bool has_bmi2();
+
+        /* Moves coefficient of the mass of every model not satisfying argument+side to its closest satisfying model.
+         * Models are walked as pairs of blocks of size 2^index, so there is no branching in the inner loop. */
+        void refine(double *distribution, std::size_t size, unsigned int index, bool positive, double coefficient);
+        /* Same update on the pairs (lo[j], hi[j]), for parts of a block pair */
+        void refine_pairs(double *lo, double *hi, std::size_t size, bool positive, double coefficient);
+        /* out[b] += sum of the models in [begin, end) where bit b is set, for every bit of a table of size 2^bits.
+         * The table is read in cache sized chunks which are folded in half once per low bit, the chunk total
+         * then goes to every high bit set in the chunk number. begin and end are multiples of the chunk size. */
+        const unsigned int marginals_chunk_bits = 10;
+        void marginals(const double *distribution, unsigned int bits, double *out, std::size_t begin, std::size_t end);
+        /* Contiguous reductions used by the gather plans */
+        double sum(const double *src, std::size_t size);
+        void accumulate(double *dst, const double *src, std::size_t size);
+        void scale(double *dst, const double *src, double factor, std::size_t size);
+
+        /* Single precision versions, same paths with twice as many models per vector */
+        void refine(float *distribution, std::size_t size, unsigned int index, bool positive, double coefficient);
+        void refine_pairs(float *lo, float *hi, std::size_t size, bool positive, double coefficient);
+        void marginals(const float *distribution, unsigned int bits, float *out, std::size_t begin, std::size_t end);
+        float sum(const float *src, std::size_t size);
+        void accumulate(float *dst, const float *src, std::size_t size);
+        void scale(float *dst, const float *src, float factor, std::size_t size);
+    }
+}
+
+#endif //SPLITTERCELL_KERNELS_H
@@ -0,0 +1,29 @@
+#ifndef SPLITTERCELL_SAMPLING_H
+#define SPLITTERCELL_SAMPLING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+
+namespace splittercell {
+    /* When basic_distribution::approximate stops: as soon as every interval is narrow enough, or when the time or the
+     * samples run out, whichever comes first. A zero turns the limit off, at least one of them has to be set. */
+    struct sampling_budget {
+        double max_error = 0.01; //Half width of the widest confidence interval
+        double seconds = 1.0;
+        std::size_t max_samples = 0;
+        double z = 1.96; //Normal quantile of the confidence level, 1.96 for 95%
+        std::uint64_t seed = 0; //Same seed and budget in samples, same answer whatever the number of threads
+    };
+
+    struct approximate_beliefs {
+        std::unordered_map<unsigned int, double> beliefs; //Share of the samples where the argument holds
+        std::unordered_map<unsigned int, std::pair<double, double>> intervals; //Wilson score intervals
+        std::size_t samples;
+        double max_error; //Half width of the widest interval
+        bool converged; //Whether max_error was reached within the budget
+    };
+}
+
+#endif //SPLITTERCELL_SAMPLING_H
@@ -0,0 +1,97 @@
+#ifndef SPLITTERCELL_SCALAR_TRAITS_H
+#define SPLITTERCELL_SCALAR_TRAITS_H
+
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include "kernels.h"
+
+namespace splittercell {
+    /* Tag for tables holding the natural logarithm of each probability: products become sums, so long chains of
+     * refinements and combinations on tiny probabilities do not underflow. Storage is T. */
+    template<typename T> struct log_space {};
+
+    /* How a flock stores its probabilities and the table operations on that storage */
+    template<typename S> struct scalar_traits;
+
+    template<typename T> struct linear_traits {
+        typedef T value_type;
+        static const bool log_space = false;
+
+        static value_type zero() {return T(0);}
+        static value_type from_probability(double p) {return T(p);}
+        static double to_probability(value_type v) {return v;}
+        static value_type add(value_type a, value_type b) {return a + b;}
+        static value_type multiply(value_type a, value_type b) {return a * b;}
+        /* Whole tables, through the vectorized kernels */
+        static void refine(T *distribution, std::size_t size, unsigned int index, bool positive, double coefficient) {
+            kernels::refine(distribution, size, index, positive, coefficient);
+        }
+        static void refine_pairs(T *lo, T *hi, std::size_t size, bool positive, double coefficient) {
+            kernels::refine_pairs(lo, hi, size, positive, coefficient);
+        }
+        static void marginals(const T *distribution, unsigned int bits, T *out, std::size_t begin, std::size_t end) {
+            kernels::marginals(distribution, bits, out, begin, end);
+        }
+        static T sum(const T *src, std::size_t size) {return kernels::sum(src, size);}
+        static void accumulate(T *dst, const T *src, std::size_t size) {kernels::accumulate(dst, src, size);}
+        static void scale(T *dst, const T *src, T factor, std::size_t size) {kernels::scale(dst, src, factor, size);}
+    };
+
+    template<> struct scalar_traits<double> : linear_traits<double> {};
+    template<> struct scalar_traits<float> : linear_traits<float> {};
+
+    template<typename T> struct scalar_traits<log_space<T>> {
+        typedef T value_type;
+        static const bool log_space = true;
+
+        static value_type zero() {return -std::numeric_limits<T>::infinity();}
+        static value_type from_probability(double p) {return T(std::log(p));}
+        static double to_probability(value_type v) {return std::exp(double(v));}
+        static value_type add(value_type a, value_type b) {
+            if(a < b)
+                std::swap(a, b);
+            if(b == zero())
+                return a;
+            return a + std::log1p(std::exp(b - a));
+        }
+        static value_type multiply(value_type a, value_type b) {return a + b;}
+        /* Same walks as the kernels, one model at a time since every addition is a log-sum-exp */
+        static void refine(T *distribution, std::size_t size, unsigned int index, bool positive, double coefficient) {
+            std::size_t block = std::size_t(1) << index;
+            for(std::size_t base = 0; base < size; base += 2 * block)
+                refine_pairs(distribution + base, distribution + base + block, block, positive, coefficient);
+        }
+        static void refine_pairs(T *lo, T *hi, std::size_t size, bool positive, double coefficient) {
+            T *from = positive ? lo : hi, *to = positive ? hi : lo;
+            T moved = from_probability(coefficient), keep = from_probability(1.0 - coefficient);
+            for(std::size_t j = 0; j < size; j++) {
+                to[j]    = add(to[j], from[j] + moved);
+                from[j] += keep;
+            }
+        }
+        static void marginals(const T *distribution, unsigned int bits, T *out, std::size_t begin, std::size_t end) {
+            for(std::size_t i = begin; i < end; i++)
+                for(unsigned int b = 0; b < bits; b++)
+                    if(i & (std::size_t(1) << b))
+                        out[b] = add(out[b], distribution[i]);
+        }
+        static T sum(const T *src, std::size_t size) {
+            T total = zero();
+            for(std::size_t j = 0; j < size; j++)
+                total = add(total, src[j]);
+            return total;
+        }
+        static void accumulate(T *dst, const T *src, std::size_t size) {
+            for(std::size_t j = 0; j < size; j++)
+                dst[j] = add(dst[j], src[j]);
+        }
+        static void scale(T *dst, const T *src, T factor, std::size_t size) {
+            for(std::size_t j = 0; j < size; j++)
+                dst[j] = src[j] + factor;
+        }
+    };
+}
+
+#endif //SPLITTERCELL_SCALAR_TRAITS_H
@@ -0,0 +1,50 @@
+#ifndef SPLITTERCELL_SERIALIZATION_H
+#define SPLITTERCELL_SERIALIZATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include "scalar_traits.h"
+
+namespace splittercell {
+    /* Binary layout of a saved distribution, in the byte order of the machine that wrote it:
+     *   file_header
+     *   per flock: flock_header, then its conditioned and conditioning arguments (uint32 each)
+     *   per argument, in slot order: argument_record
+     *   every table in flock order, each one starting on an alignment boundary (zero padding in between)
+     * Tables are stored exactly as in memory, so a mapped file is used without parsing or copying. */
+    namespace serialization {
+        const char magic[8] = {'S', 'P', 'L', 'I', 'T', 'C', 'E', 'L'};
+        const std::uint32_t version = 1;
+        const std::size_t alignment = 64;
+        const std::uint32_t no_flock = 0xFFFFFFFFU;
+
+        struct file_header {
+            char magic[8];
+            std::uint32_t version, scalar;
+            std::uint64_t flocks, arguments;
+        };
+
+        struct flock_header {
+            std::uint32_t conditioned, conditioning, uniform, reserved;
+            std::uint64_t offset, models; //Of the table, from the start of the file
+        };
+
+        struct argument_record {
+            std::uint32_t argument, flock, valid, reserved; //flock is no_flock for arguments outside every flock
+            double belief;
+        };
+
+        static_assert(sizeof(file_header) == 32 && sizeof(flock_header) == 32 && sizeof(argument_record) == 24,
+                      "The records are written as they are in memory.");
+
+        inline std::size_t aligned(std::size_t offset) {return (offset + alignment - 1) / alignment * alignment;}
+
+        /* Which scalar the tables are stored as, a file only loads into a distribution of the same one */
+        template<typename S> struct scalar_code;
+        template<> struct scalar_code<double> {static const std::uint32_t value = 1;};
+        template<> struct scalar_code<float> {static const std::uint32_t value = 2;};
+        template<> struct scalar_code<log_space<double>> {static const std::uint32_t value = 3;};
+    }
+}
+
+#endif //SPLITTERCELL_SERIALIZATION_H
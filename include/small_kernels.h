@@ -0,0 +1,103 @@
+#ifndef SPLITTERCELL_SMALL_KERNELS_H
+#define SPLITTERCELL_SMALL_KERNELS_H
+
+#include <array>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace splittercell {
+    /* Kernels for tables of at most max_bits arguments, which fit in a few cache lines. The number of arguments is a
+     * template parameter, so every loop has a constant trip count and is unrolled, and the index mappings are built
+     * on the stack by each call instead of looking up the cached gather and product plans. traits is the
+     * scalar_traits of the table. Bit masks describe where each bit of an index goes: masks[b] is the bit of the
+     * other index that bit b sets, or 0 if it is dropped. */
+    namespace small {
+        const unsigned int max_bits = 8;
+        const unsigned int max_streamed_bits = 6; //Past it the vectorized kernels win on refine and marginals
+        typedef std::array<std::uint8_t, max_bits> masks;
+
+        /* f(std::integral_constant<unsigned int, bits>()), for bits <= Bits */
+        template<unsigned int Bits = max_bits>
+        struct by_size {
+            template<typename F>
+            static void call(unsigned int bits, F &&f) {
+                if(bits == Bits)
+                    return f(std::integral_constant<unsigned int, Bits>());
+                by_size<Bits - 1>::call(bits, std::forward<F>(f));
+            }
+        };
+        template<>
+        struct by_size<0> {
+            template<typename F>
+            static void call(unsigned int, F &&f) {f(std::integral_constant<unsigned int, 0>());}
+        };
+
+        /* Image of every index of Bits bits, each set bit b contributing m[b] */
+        template<unsigned int Bits>
+        std::array<std::uint8_t, (std::size_t(1) << Bits)> index_map(const masks &m) {
+            std::array<std::uint8_t, (std::size_t(1) << Bits)> map;
+            map[0] = 0;
+            for(unsigned int b = 0; b < Bits; b++)
+                for(std::size_t i = 0; i < (std::size_t(1) << b); i++)
+                    map[i + (std::size_t(1) << b)] = map[i] | m[b];
+            return map;
+        }
+
+        /* Same update as kernels::refine: to += coefficient * from, from *= 1 - coefficient on each pair of blocks of
+         * 2^Index models. The index is a template parameter too, so both loops have constant bounds. */
+        template<unsigned int Bits, unsigned int Index, typename traits>
+        void refine(typename traits::value_type *t, bool positive, double coefficient) {
+            typename traits::value_type moved = traits::from_probability(coefficient), keep = traits::from_probability(1.0 - coefficient);
+            const std::size_t block = std::size_t(1) << Index;
+            typename traits::value_type *from = t + (positive ? 0 : block), *to = t + (positive ? block : 0);
+            for(std::size_t base = 0; base + block < (std::size_t(1) << Bits); base += 2 * block)
+                for(std::size_t j = base; j < base + block; j++) {
+                    to[j]   = traits::add(to[j], traits::multiply(from[j], moved));
+                    from[j] = traits::multiply(from[j], keep);
+                }
+        }
+
+        template<unsigned int Bits, typename traits>
+        void refine(typename traits::value_type *t, unsigned int index, bool positive, double coefficient) {
+            by_size<(Bits > 0) ? Bits - 1 : 0>::call(index, [=](auto i) {refine<Bits, decltype(i)::value, traits>(t, positive, coefficient);});
+        }
+
+        /* out[b] = sum of the models where bit b is set. The table is folded in half from its highest bit down, the
+         * upper half of each fold sums the models where that bit is set. */
+        template<unsigned int Bits, typename traits>
+        void marginals(const typename traits::value_type *t, typename traits::value_type *out) {
+            std::array<typename traits::value_type, (std::size_t(1) << Bits)> folded;
+            std::copy(t, t + folded.size(), folded.begin());
+            for(unsigned int b = Bits; b-- > 0;) {
+                typename traits::value_type total = traits::zero();
+                for(std::size_t j = 0; j < (std::size_t(1) << b); j++) {
+                    total     = traits::add(total, folded[j + (std::size_t(1) << b)]);
+                    folded[j] = traits::add(folded[j], folded[j + (std::size_t(1) << b)]);
+                }
+                out[b] = total;
+            }
+        }
+
+        /* dst (zeroed by the caller) += src summed over the dropped bits */
+        template<unsigned int Bits, typename traits>
+        void marginalize(const typename traits::value_type *src, typename traits::value_type *dst, const masks &destination) {
+            auto map = index_map<Bits>(destination);
+            for(std::size_t i = 0; i < map.size(); i++)
+                dst[map[i]] = traits::add(dst[map[i]], src[i]);
+        }
+
+        /* out = a * b, where first (second) gives the bits of a product index in a (b) */
+        template<unsigned int Bits, typename traits>
+        void multiply(const typename traits::value_type *a, const typename traits::value_type *b, typename traits::value_type *out,
+                      const masks &first, const masks &second) {
+            auto in_a = index_map<Bits>(first), in_b = index_map<Bits>(second);
+            for(std::size_t i = 0; i < in_a.size(); i++)
+                out[i] = traits::multiply(a[in_a[i]], b[in_b[i]]);
+        }
+    }
+}
+
+#endif //SPLITTERCELL_SMALL_KERNELS_H
@@ -0,0 +1,86 @@
+#ifndef SPLITTERCELL_STATS_H
+#define SPLITTERCELL_STATS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+/* Instrumentation is compiled into the library with -DSPLITTERCELL_STATS=1 (the SPLITTERCELL_STATS CMake option). Without
+ * it every recording call below returns at once, the counters stay at zero and the callback is never called. The switch
+ * is only read in src/stats.cpp, so code built with other flags still sees the library's setting. */
+namespace splittercell {
+    namespace stats {
+        extern const bool enabled; //Same as compiled_in(), for the recording calls below
+
+        enum class kernel {refine, marginalize, combine, marginals, elimination};
+        const unsigned int kernel_count = 5;
+
+        enum class counter {queries, belief_hits, belief_misses, factor_hits, factor_misses, combines, combined_models,
+                            largest_combined, bytes_allocated, bytes_live, parallel_loops, tasks, steals, busy_nanoseconds,
+                            capacity_nanoseconds};
+        const unsigned int counter_count = 15;
+
+        /* Process-wide totals since the start or the last reset() */
+        struct snapshot {
+            std::uint64_t queries;
+            std::uint64_t belief_hits, belief_misses; //Arguments answered from the belief cache or not
+            std::uint64_t factor_hits, factor_misses; //Intermediate factors found in the factor caches or computed
+            std::uint64_t combines, combined_models, largest_combined; //Products, their total size, most arguments in one
+            std::uint64_t bytes_allocated, bytes_live; //Flock tables
+            std::uint64_t parallel_loops, tasks, steals; //Thread pool loops, chunks run and chunks taken from another queue
+            std::uint64_t busy_nanoseconds, capacity_nanoseconds; //Time in chunks, and length of the loops times threads
+            std::array<std::uint64_t, kernel_count> kernel_calls, kernel_nanoseconds;
+
+            /* Share of the pool threads time spent running chunks during parallel loops */
+            double utilisation() const {return capacity_nanoseconds ? double(busy_nanoseconds) / capacity_nanoseconds : 0.0;}
+        };
+
+        /* What a single distribution::operator[] did */
+        struct query_report {
+            std::size_t arguments, belief_hits, belief_misses, factor_hits, factor_misses;
+            unsigned int largest_table; //Most arguments in a single table built
+            std::uint64_t nanoseconds;
+        };
+
+        bool compiled_in(); //Whether the library itself was built with SPLITTERCELL_STATS
+        snapshot current();
+        void reset();
+        /* Called at the end of every query, from the querying thread; pass nullptr to remove it */
+        void set_query_callback(std::function<void(const query_report &)> callback);
+
+        /* Recording, used by the library */
+        void add_counter(counter c, std::uint64_t n);
+        void max_counter(counter c, std::uint64_t n);
+        void add_kernel(kernel k, std::uint64_t nanoseconds);
+        void report(const query_report &r);
+
+        inline std::uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        inline void count(counter c, std::uint64_t n = 1) {
+            if(enabled)
+                add_counter(c, n);
+        }
+        inline void maximum(counter c, std::uint64_t n) {
+            if(enabled)
+                max_counter(c, n);
+        }
+
+        /* Times its scope as one call of a kernel */
+        class kernel_timer {
+        public:
+            explicit kernel_timer(kernel k) : _kernel(k), _start(enabled ? now() : 0) {}
+            ~kernel_timer() {
+                if(enabled)
+                    add_kernel(_kernel, now() - _start);
+            }
+
+        private:
+            kernel _kernel;
+            std::uint64_t _start;
+        };
+    }
+}
+
+#endif //SPLITTERCELL_STATS_H
@@ -0,0 +1,146 @@
+#ifndef SPLITTERCELL_TABLE_STORAGE_H
+#define SPLITTERCELL_TABLE_STORAGE_H
+
+#include <cstddef>
+#include <string>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+
+namespace splittercell {
+    /* Where flock tables live. Small tables come from the heap. Tables of at least mapped_threshold bytes are memory
+     * mapped without reserving swap, with a transparent huge page hint: anonymous by default, or backed by a sparse
+     * unlinked file in directory, so that tables larger than the RAM page out to disk instead of failing. */
+    namespace storage {
+        struct policy {
+            std::size_t mapped_threshold;
+            std::string directory; //Empty for anonymous mappings
+        };
+        const std::size_t default_mapped_threshold = std::size_t(64) << 20;
+
+        policy current_policy();
+        void set_policy(const policy &p); //Only affects the tables allocated afterwards
+        std::size_t mapped_bytes(); //Currently mapped by live tables
+
+        /* 64 bytes aligned, throws std::bad_alloc. Taken from the workspace bound to the thread if there is one. */
+        void *allocate(std::size_t bytes);
+        void deallocate(void *p, std::size_t bytes);
+
+        const std::size_t default_workspace_limit = std::size_t(64) << 20;
+
+        /* Recycles the blocks allocated while it is bound to a thread (see scope): a block freed later, from any
+         * thread, goes back to its workspace and the next allocation of the same size takes it instead of asking the
+         * system again. At most limit bytes are kept aside, the rest is freed. Blocks still in use when the workspace
+         * goes away are freed normally once released. Thread safe. */
+        class workspace {
+        public:
+            /* Constructors */
+            explicit workspace(std::size_t limit = default_workspace_limit);
+            workspace(const workspace &) = delete;
+            workspace &operator=(const workspace &) = delete;
+            ~workspace();
+            /* Accessors */
+            std::size_t fresh() const;  //Blocks allocated from the system
+            std::size_t reused() const; //Allocations served from the blocks kept aside
+            std::size_t kept_bytes() const;
+            /* Modifiers */
+            void trim(); //Frees the blocks kept aside
+
+            /* Binds a workspace to the current thread for its lifetime, nullptr unbinds it */
+            class scope {
+            public:
+                explicit scope(workspace *w);
+                scope(const scope &) = delete;
+                scope &operator=(const scope &) = delete;
+                ~scope();
+
+            private:
+                void *_previous;
+            };
+
+        private:
+            struct pool;
+            pool *_pool; //Also referenced by every block it handed out
+
+            friend void *allocate(std::size_t bytes);
+            friend void deallocate(void *p, std::size_t bytes);
+        };
+        /* Private writable mapping of a whole file, changes stay in the process. Throws std::runtime_error. */
+        std::shared_ptr<char> map_file(const std::string &path, std::size_t &length);
+        /* Replaces path with what write puts in the stream, through a sibling file synced and renamed over it once
+         * complete: path is never left half written, and mappings of the previous file keep reading it. Throws
+         * std::runtime_error. */
+        void replace_file(const std::string &path, const std::function<void(std::ostream &)> &write);
+    }
+
+    /* Storage of the probabilities of a flock, indexed by model. Behaves as a fixed size vector, except that it can
+     * also be a view of memory kept alive by someone else (a table inside a mapped file), which is then modified in
+     * place. Copies are always deep and own their storage. */
+    template<typename T>
+    class table {
+    public:
+        typedef T value_type;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef T *iterator;
+        typedef const T *const_iterator;
+        typedef std::size_t size_type;
+
+        /* Constructors */
+        table() : _data(nullptr), _size(0), _owns(false) {}
+        explicit table(std::size_t size) : table() {allocate(size);} //Left uninitialised, for tables about to be overwritten
+        table(std::size_t size, const T &value) : table() {allocate(size); std::fill_n(_data, size, value);}
+        template<typename It, typename = typename std::enable_if<!std::is_integral<It>::value>::type>
+        table(It first, It last) : table() {allocate(std::distance(first, last)); std::copy(first, last, _data);}
+        table(T *data, std::size_t size, std::shared_ptr<void> owner) : _data(data), _size(size), _owns(false), _owner(std::move(owner)) {}
+        table(const table &other) : table(other.cbegin(), other.cend()) {}
+        table(table &&other) noexcept : table() {swap(other);}
+        table &operator=(table other) {swap(other); return *this;}
+        ~table() {
+            if(_owns)
+                storage::deallocate(_data, _size * sizeof(T));
+        }
+        /* Accessors */
+        std::size_t size() const {return _size;}
+        bool empty() const {return _size == 0;}
+        T *data() {return _data;}
+        const T *data() const {return _data;}
+        T &operator[](std::size_t i) {return _data[i];}
+        const T &operator[](std::size_t i) const {return _data[i];}
+        iterator begin() {return _data;}
+        iterator end() {return _data + _size;}
+        const_iterator begin() const {return _data;}
+        const_iterator end() const {return _data + _size;}
+        const_iterator cbegin() const {return _data;}
+        const_iterator cend() const {return _data + _size;}
+        bool operator==(const table &other) const {return _size == other._size && std::equal(cbegin(), cend(), other.cbegin());}
+        bool operator!=(const table &other) const {return !(*this == other);}
+        /* Modifiers */
+        void assign(std::size_t size, const T &value) {table(size, value).swap(*this);}
+        template<typename It>
+        void assign(It first, It last) {table(first, last).swap(*this);}
+        void swap(table &other) noexcept {
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+            std::swap(_owns, other._owns);
+            std::swap(_owner, other._owner);
+        }
+
+    private:
+        T *_data;
+        std::size_t _size;
+        bool _owns; //Its own storage, released with it
+        std::shared_ptr<void> _owner; //Keeps the memory of a view alive
+
+        void allocate(std::size_t size) {
+            _data = static_cast<T*>(storage::allocate(size * sizeof(T)));
+            _size = size;
+            _owns = true;
+        }
+    };
+}
+
+#endif //SPLITTERCELL_TABLE_STORAGE_H
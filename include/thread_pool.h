@@ -0,0 +1,93 @@
+#ifndef SPLITTERCELL_THREAD_POOL_H
+#define SPLITTERCELL_THREAD_POOL_H
+
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace splittercell {
+    const std::size_t cache_line_doubles = 64 / sizeof(double);
+    const unsigned int parallel_threshold_bits = 15; //Smaller tables are not worth waking threads for
+
+    /* Runs the chunks of a parallel loop, implement it to plug your own scheduler */
+    class executor {
+    public:
+        virtual ~executor() = default;
+        virtual unsigned int concurrency() const = 0;
+        /* Calls body(begin, end) on disjoint ranges covering [0, bound), each a multiple of grain except the last
+         * one, and returns once all of them are done. */
+        virtual void parallel_for(std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &body) = 0;
+    };
+
+    class sequential_executor : public executor {
+    public:
+        unsigned int concurrency() const override {return 1;}
+        void parallel_for(std::size_t bound, std::size_t, const std::function<void(std::size_t, std::size_t)> &body) override {
+            if(bound > 0)
+                body(0, bound);
+        }
+    };
+
+    /* Persistent workers with one deque each: chunks are dealt out in contiguous runs, taken from the front of the
+     * own deque and stolen from the back of the others. The calling thread works too until its loop is done. */
+    class thread_pool : public executor {
+    public:
+        explicit thread_pool(unsigned int threads = std::thread::hardware_concurrency());
+        ~thread_pool();
+        unsigned int concurrency() const override {return _queues.size();}
+        void parallel_for(std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &body) override;
+
+        /* Process-wide pool used by default, created on first use with one thread per core */
+        static std::shared_ptr<thread_pool> shared();
+        static void set_shared_threads(unsigned int threads);
+
+    private:
+        struct job;
+        struct task {
+            job *owner;
+            std::size_t begin, end;
+        };
+        struct queue {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        std::vector<std::unique_ptr<queue>> _queues; //_queues[0] is fed to the calling threads
+        std::vector<std::thread> _workers;
+        std::mutex _sleep_mutex;
+        std::condition_variable _wake;
+        std::atomic<std::size_t> _pending;
+        bool _stop;
+
+        bool run_one(unsigned int self);
+        void work(unsigned int self);
+    };
+
+    /* Runs every loop on another executor (the process-wide pool by default) in at most threads chunks, so that no
+     * more than threads of its workers take part. It has no thread of its own. */
+    class capped_executor : public executor {
+    public:
+        explicit capped_executor(unsigned int threads, std::shared_ptr<executor> target = thread_pool::shared()) :
+                _threads(std::max(threads, 1U)), _target(std::move(target)) {}
+        unsigned int concurrency() const override {return std::min(_threads, _target->concurrency());}
+        void parallel_for(std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &body) override {
+            grain = std::max<std::size_t>(grain, 1);
+            std::size_t chunks = (bound + grain - 1) / grain;
+            _target->parallel_for(bound, (chunks + _threads - 1) / _threads * grain, body);
+        }
+
+    private:
+        unsigned int _threads;
+        std::shared_ptr<executor> _target;
+    };
+
+    sequential_executor &no_parallelism();
+}
+
+#endif //SPLITTERCELL_THREAD_POOL_H
@@ -1,109 +1,450 @@
 #include <stdexcept>
-#include <limits>
+#include <algorithm>
 #include <sstream>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <map>
 #include "distribution.h"
+#include "elimination.h"
 
 namespace splittercell {
-    distribution::distribution(std::vector<std::unique_ptr<flock>> &flocks, bool mt) : _flocks(std::move(flocks)), _mt(mt) {
+    template<typename S>
+    basic_distribution<S>::basic_distribution(std::vector<std::unique_ptr<flock_type>> &flocks, std::shared_ptr<executor> exec) :
+            _executor(std::move(exec)), _factors(std::make_shared<basic_factor_cache<S>>()), _workspace(std::make_shared<storage::workspace>()) {
+        for(auto &f : flocks)
+            _flocks.push_back(std::move(f));
+        flocks.clear();
         unsigned int flock_index = 0;
         for (auto &f : _flocks) {
+            _versions.push_back(next_version());
+            _published_flocks.push_back(false);
             for (auto conditioned : f->conditioned()) {
-                if (_mapping.find(conditioned) != _mapping.end())
+                if (_slots.contains(conditioned))
                     throw std::invalid_argument("An argument cannot be in different flocks.");
-                _mapping[conditioned] = flock_index;
-                if(f->uniform()) {
-                    _belief_cache[conditioned]   = 0.5;
-                    _cache_is_valid[conditioned] = true;
-                } else
-                    _cache_is_valid[conditioned] = false;
+                //If the distribution is uniform, 0.5 can be cached right away
+                add_argument(conditioned, flock_index, f->uniform(), 0.5);
             }
             flock_index++;
         }
+        link_flocks();
     }
 
-    distribution::distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial, bool mt) : _mt(mt) {
+    template<typename S>
+    basic_distribution<S>::basic_distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial,
+                                              std::shared_ptr<executor> exec) :
+            _executor(std::move(exec)), _factors(std::make_shared<basic_factor_cache<S>>()), _workspace(std::make_shared<storage::workspace>()) {
         for(auto a : arguments) {
             auto it = initial.find(a);
-            if(it == initial.cend())
-              _belief_cache[a] = 0.5;
-            else
-              _belief_cache[a] = it->second;
-            _cache_is_valid[a] = true;
+            add_argument(a, argument_map::npos, true, (it == initial.cend()) ? 0.5 : it->second);
         }
+        link_flocks();
     }
 
-    distribution::distribution(const distribution &other) : _mapping(other._mapping), _belief_cache(other._belief_cache),
-                                                            _cache_is_valid(other._cache_is_valid), _mt(other._mt) {
-        for(auto &f : other._flocks)
-            _flocks.push_back(std::make_unique<flock>(*f));
-    }
+    template<typename S>
+    basic_distribution<S>::basic_distribution(std::vector<std::unique_ptr<flock_type>> &flocks, bool mt) :
+            basic_distribution(flocks, mt ? std::shared_ptr<executor>() : std::make_shared<sequential_executor>()) {}
+
+    template<typename S>
+    basic_distribution<S>::basic_distribution(const std::vector<unsigned int> &arguments, const std::unordered_map<unsigned int, double> &initial,
+                                              bool mt) :
+            basic_distribution(arguments, initial, mt ? std::shared_ptr<executor>() : std::make_shared<sequential_executor>()) {}
 
-    std::unordered_map<unsigned int, double> distribution::operator[](const std::vector<unsigned int> &arguments) {
+    template<typename S>
+    basic_distribution<S>::basic_distribution(const basic_distribution &other) : _flocks(other._flocks), _slots(other._slots), _arguments(other._arguments),
+                                                                          _flock_of(other._flock_of), _dependents(other._dependents),
+                                                                          _belief_cache(other._belief_cache),
+                                                                          _cache_is_valid(other._cache_is_valid), _executor(other._executor),
+                                                                          _versions(other._versions), _published_flocks(other._published_flocks),
+                                                                          _factors(other._factors),
+                                                                          _workspace(std::make_shared<storage::workspace>()) {}
+
+    template<typename S>
+    std::unordered_map<unsigned int, double> basic_distribution<S>::operator[](const std::vector<unsigned int> &arguments) {
+        std::uint64_t start = stats::enabled ? stats::now() : 0;
+        std::size_t factor_hits = stats::enabled ? _factors->hits() : 0, factor_misses = stats::enabled ? _factors->misses() : 0;
         std::set<unsigned int> args_for_combine(arguments.cbegin(), arguments.cend());
         std::unordered_map<unsigned int, double> beliefs;
-        std::unique_ptr<flock> f = nullptr;
-        for(auto arg : arguments)
-            if(_cache_is_valid.at(arg)) {
-                beliefs[arg] = _belief_cache.at(arg);
+        for(auto arg : arguments) {
+            auto slot = _slots.at(arg);
+            if(_cache_is_valid[slot]) {
+                beliefs[arg] = _belief_cache[slot];
                 args_for_combine.erase(arg);
             }
+        }
 
-        for(auto arg : args_for_combine) {
-            if(f == nullptr)
-                f = find_and_combine(std::vector<unsigned int>(args_for_combine.cbegin(), args_for_combine.cend()));
-            beliefs[arg] = f->marginalize({arg})->distribution()[1];
+        storage::workspace::scope scope(_workspace.get());
+        auto largest = compute_beliefs(args_for_combine, beliefs, _executor.get());
+        if(stats::enabled) {
+            stats::query_report r = {arguments.size(), beliefs.size() - args_for_combine.size(), args_for_combine.size(),
+                                     _factors->hits() - factor_hits, _factors->misses() - factor_misses, largest, stats::now() - start};
+            stats::count(stats::counter::queries);
+            stats::count(stats::counter::belief_hits, r.belief_hits);
+            stats::count(stats::counter::belief_misses, r.belief_misses);
+            stats::report(r);
         }
 
         for(auto b : beliefs) {
-            _cache_is_valid[b.first] = true;
-            _belief_cache[b.first]   = b.second;
+            auto slot = _slots.at(b.first);
+            _cache_is_valid[slot] = true;
+            _belief_cache[slot]   = b.second;
         }
 
         return beliefs;
     }
 
-    void distribution::find_conditioning(unsigned int argument, std::set<unsigned int> &conditioning) const {
-        auto f = _flocks[_mapping.at(argument)].get();
+    template<typename S>
+    std::unordered_map<unsigned int, double> basic_distribution<S>::beliefs_all() {
+        return (*this)[_arguments];
+    }
+
+    template<typename S>
+    std::vector<std::unordered_map<unsigned int, double>> basic_distribution<S>::what_if(const std::vector<update> &candidates,
+                                                                                         const std::vector<unsigned int> &targets) const {
+        for(auto &u : candidates)
+            if(_flock_of[_slots.at(u.argument)] == argument_map::npos)
+                throw std::invalid_argument(std::to_string(u.argument) + " is not in any flock.");
+
+        /* Beliefs as they are now, shared by every candidate */
+        std::unordered_map<unsigned int, double> current;
+        std::set<unsigned int> missing;
+        for(auto arg : targets) {
+            auto slot = _slots.at(arg);
+            if(_cache_is_valid[slot])
+                current[arg] = _belief_cache[slot];
+            else
+                missing.insert(arg);
+        }
+        storage::workspace::scope scope(_workspace.get());
+        compute_beliefs(missing, current, _executor.get());
+
+        std::vector<std::unordered_map<unsigned int, double>> results(candidates.size());
+        auto pool = thread_pool::shared();
+        executor *exec = _executor ? _executor.get() : pool.get();
+        exec->parallel_for(candidates.size(), 1, [&](std::size_t begin, std::size_t end) {
+            storage::workspace::scope worker(_workspace.get());
+            for(std::size_t c = begin; c < end; c++) {
+                auto &u = candidates[c];
+                auto slot = _slots.at(u.argument);
+                auto changed = dependents({slot});
+                std::set<unsigned int> downstream;
+                for(auto arg : targets) {
+                    auto s = _slots.at(arg);
+                    if(s == slot)
+                        results[c][arg] = refined_belief(current.at(arg), u.positive, u.coefficient);
+                    else if(changed[s])
+                        downstream.insert(arg);
+                    else
+                        results[c][arg] = current.at(arg);
+                }
+                if(downstream.empty())
+                    continue;
+
+                /* Named after the flock it comes from and the refinement, the same candidate later reuses its factors */
+                auto f = _flock_of[slot];
+                flock_type refined(*_flocks[f]);
+                refined.refine(u.argument, u.positive, u.coefficient, &no_parallelism());
+                std::ostringstream signature;
+                signature << _versions[f] << (u.positive ? '+' : '-') << u.argument << ':' << std::hexfloat << u.coefficient;
+                flock_override override = {f, &refined, signature.str()};
+                compute_beliefs(downstream, results[c], &no_parallelism(), &override);
+            }
+        });
+        return results;
+    }
+
+    /* Flocks without conditioning are swept on their own, every other flock gets its own elimination over its ancestors:
+     * the factors they share are built once and found in the factor cache by the next ones, and no table grows with the
+     * number of arguments asked for. Returns the most arguments in a single table used. */
+    template<typename S>
+    unsigned int basic_distribution<S>::compute_beliefs(const std::set<unsigned int> &arguments, std::unordered_map<unsigned int, double> &beliefs,
+                                                        executor *exec, const flock_override *override) const {
+        unsigned int largest = 0;
+        std::map<unsigned int, std::vector<unsigned int>> to_combine; //Arguments by flock
+        std::set<unsigned int> swept;
+        for(auto arg : arguments) {
+            auto index = _flock_of[_slots.at(arg)];
+            auto f = (override && override->flock == index) ? override->replacement : _flocks[index].get();
+            if(!f->conditioning().empty())
+                to_combine[index].push_back(arg);
+            else if(swept.insert(index).second) {
+                largest = std::max(largest, f->size());
+                auto marginals = f->all_marginals(exec);
+                for(auto conditioned : f->conditioned())
+                    if(arguments.count(conditioned))
+                        beliefs[conditioned] = marginals[f->index(conditioned)];
+            }
+        }
+
+        for(auto &target : to_combine) {
+            auto f = find_and_combine(target.second, largest, exec, override);
+            auto marginals = f->all_marginals(exec);
+            for(auto arg : target.second)
+                beliefs[arg] = marginals[f->index(arg)];
+        }
+        return largest;
+    }
+
+    template<typename S>
+    void basic_distribution<S>::find_conditioning(unsigned int argument, std::set<unsigned int> &conditioning) const {
+        auto f = _flocks[_flock_of[_slots.at(argument)]].get();
         for(auto cond : f->conditioning()) {
             conditioning.insert(cond);
             find_conditioning(cond, conditioning);
         }
     }
 
-    std::unique_ptr<flock> distribution::find_and_combine(const std::vector<unsigned int> &arguments) const {
-        std::set<unsigned int> conditioning_args;
-        std::set<flock*> conditioning_flocks;
+    template<typename S>
+    std::shared_ptr<const basic_flock<S>> basic_distribution<S>::find_and_combine(const std::vector<unsigned int> &arguments, unsigned int &largest,
+                                                                                  executor *exec, const flock_override *override) const {
+        std::set<unsigned int> conditioning_args, conditioning_flocks;
         for(auto arg : arguments) {
             find_conditioning(arg, conditioning_args);
-            conditioning_flocks.insert(_flocks[_mapping.at(arg)].get());
+            conditioning_flocks.insert(_flock_of[_slots.at(arg)]);
         }
         for(auto arg : conditioning_args)
-            conditioning_flocks.insert(_flocks[_mapping.at(arg)].get());
-
-        auto it = conditioning_flocks.cbegin();
-        auto combined = *it;
-        std::unique_ptr<flock> ptrcombined = nullptr, ptrnext = nullptr;
-        ++it;
-        unsigned int limit = std::numeric_limits<unsigned int>::digits - 2;
-        while(it != conditioning_flocks.cend()) {
-            auto next = *it;
-            if(combined->size() + next->size() > limit) {
-                auto all = std::vector<unsigned int>(arguments);
-                all.insert(all.cend(), conditioning_args.cbegin(), conditioning_args.cend());
-                ptrcombined = combined->marginalize(all);
-                combined = ptrcombined.get();
-                ptrnext = next->marginalize(all);
-                next = ptrnext.get();
+            conditioning_flocks.insert(_flock_of[_slots.at(arg)]);
+
+        std::vector<const flock_type*> flocks;
+        std::vector<std::string> signatures;
+        for(auto f : conditioning_flocks)
+            if(override && override->flock == f) {
+                flocks.push_back(override->replacement);
+                signatures.push_back(override->signature);
+            } else {
+                flocks.push_back(_flocks[f].get());
+                signatures.push_back(std::to_string(_versions[f]));
             }
-            ptrcombined = combined->combine(next, _mt);
-            combined = ptrcombined.get();
-            ++it;
+        basic_elimination<S> engine(flocks, signatures, _factors.get(), exec);
+        auto joint = engine.joint(arguments);
+        largest = std::max(largest, engine.peak());
+        return joint;
+    }
+
+    template<typename S>
+    unsigned int basic_distribution<S>::add_argument(unsigned int argument, unsigned int f, bool valid, double belief) {
+        unsigned int slot = _arguments.size();
+        _slots.insert(argument, slot);
+        _arguments.push_back(argument);
+        _flock_of.push_back(f);
+        _belief_cache.push_back(belief);
+        _cache_is_valid.push_back(valid);
+        return slot;
+    }
+
+    template<typename S>
+    void basic_distribution<S>::link_flocks() {
+        _dependents.assign(_arguments.size(), {});
+        for(unsigned int f = 0; f < _flocks.size(); f++)
+            for(auto arg : _flocks[f]->conditioning())
+                if(_slots.contains(arg))
+                    _dependents[_slots.at(arg)].push_back(f);
+    }
+
+    template<typename S>
+    void basic_distribution<S>::publish() {
+        auto previous = published();
+        std::shared_ptr<const basic_snapshot<S>> s = std::make_shared<basic_snapshot<S>>(*this, previous ? previous->generation() + 1 : 1);
+        _published_flocks.assign(_flocks.size(), true);
+        std::atomic_store(&_published, s);
+    }
+
+    template<typename S>
+    basic_snapshot<S>::basic_snapshot(const basic_distribution<S> &d, std::uint64_t generation) : _distribution(d), _beliefs(d._arguments.size()),
+                                                                                                 _generation(generation) {
+        for(unsigned int slot = 0; slot < _beliefs.size(); slot++)
+            _beliefs[slot] = d._cache_is_valid[slot] ? d._belief_cache[slot] : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    /* Two readers missing the same belief both compute it, the value is the same */
+    template<typename S>
+    std::unordered_map<unsigned int, double> basic_snapshot<S>::operator[](const std::vector<unsigned int> &arguments) const {
+        std::unordered_map<unsigned int, double> beliefs;
+        std::set<unsigned int> missing;
+        for(auto arg : arguments) {
+            double b = _beliefs[_distribution._slots.at(arg)].load(std::memory_order_relaxed);
+            if(std::isnan(b))
+                missing.insert(arg);
+            else
+                beliefs[arg] = b;
+        }
+        if(missing.empty())
+            return beliefs;
+
+        storage::workspace::scope scope(_distribution._workspace.get());
+        _distribution.compute_beliefs(missing, beliefs, &no_parallelism());
+        for(auto arg : missing)
+            _beliefs[_distribution._slots.at(arg)].store(beliefs[arg], std::memory_order_relaxed);
+        return beliefs;
+    }
+
+    template<typename S>
+    std::size_t basic_distribution<S>::checkpoint() {
+        _checkpoints.push_back({{}, _versions, _belief_cache, _cache_is_valid, _flock_of});
+        return _checkpoints.size();
+    }
+
+    template<typename S>
+    void basic_distribution<S>::rollback() {
+        if(_checkpoints.empty())
+            throw std::logic_error("No checkpoint to roll back to.");
+        auto &state = _checkpoints.back();
+        for(auto &saved : state.flocks) {
+            _flocks[saved.first]           = std::move(saved.second);
+            _published_flocks[saved.first] = true; //Could have been published before its change
+        }
+        _versions       = std::move(state.versions); //The factors cached for these versions are valid again
+        _belief_cache   = std::move(state.belief_cache);
+        _cache_is_valid = std::move(state.cache_is_valid);
+        _flock_of       = std::move(state.flock_of);
+        _checkpoints.pop_back();
+        link_flocks();
+    }
+
+    template<typename S>
+    void basic_distribution<S>::commit() {
+        if(_checkpoints.empty())
+            throw std::logic_error("No checkpoint to commit.");
+        auto state = std::move(_checkpoints.back());
+        _checkpoints.pop_back();
+        if(_checkpoints.empty())
+            return;
+        auto &outer = _checkpoints.back().flocks; //The outer checkpoint needs the oldest copy of each flock
+        for(auto &saved : state.flocks)
+            if(std::find_if(outer.cbegin(), outer.cend(), [&saved](const std::pair<unsigned int, std::shared_ptr<flock_type>> &o) {
+                    return o.first == saved.first;}) == outer.cend())
+                outer.push_back(std::move(saved));
+    }
+
+    template<typename S>
+    void basic_distribution<S>::set_cache_budget(std::size_t bytes) {
+        if(_factors.use_count() > 1)
+            _factors = std::make_shared<basic_factor_cache<S>>(*_factors);
+        _factors->set_budget(bytes);
+    }
+
+    template<typename S>
+    void basic_distribution<S>::set_probabilities(unsigned int f, const std::vector<value_type> &probabilities) {
+        modify(f)->set_probabilities(probabilities);
+        std::vector<unsigned int> changed;
+        for(auto arg : _flocks[f]->conditioned()) {
+            changed.push_back(_slots.at(arg));
+            _cache_is_valid[changed.back()] = false;
+        }
+        invalidate_dependents(changed);
+    }
+
+    template<typename S>
+    void basic_distribution<S>::refine(unsigned int argument, bool positive, double coefficient) {
+        auto slot = _slots.at(argument);
+        if(_flock_of[slot] == argument_map::npos)
+            throw std::invalid_argument(std::to_string(argument) + " is not in any flock.");
+        modify(_flock_of[slot])->refine(argument, positive, coefficient, _executor.get());
+        refine_belief(slot, positive, coefficient);
+        invalidate_dependents({slot});
+    }
+
+    template<typename S>
+    void basic_distribution<S>::refine_batch(const std::vector<update> &updates) {
+        std::map<unsigned int, std::vector<update>> per_flock; //In the order given within a flock
+        std::vector<unsigned int> slots;
+        for(auto &u : updates) {
+            auto slot = _slots.at(u.argument);
+            if(_flock_of[slot] == argument_map::npos)
+                throw std::invalid_argument(std::to_string(u.argument) + " is not in any flock.");
+            per_flock[_flock_of[slot]].push_back(u);
+            slots.push_back(slot);
+        }
+        for(auto &f : per_flock)
+            modify(f.first)->refine_batch(f.second, _executor.get());
+        for(std::size_t u = 0; u < updates.size(); u++)
+            refine_belief(slots[u], updates[u].positive, updates[u].coefficient);
+        invalidate_dependents(slots);
+    }
+
+    template<typename S>
+    void basic_distribution<S>::observe(unsigned int argument, bool value) {
+        auto slot = _slots.at(argument);
+        auto f    = _flock_of[slot];
+        if(f == argument_map::npos)
+            throw std::invalid_argument(std::to_string(argument) + " is not in any flock.");
+        /* As refine(argument, value, 1.0): the rest of the flock keeps its beliefs, only those downstream of the argument
+         * change (found before the flocks conditioned on it stop being linked to it) */
+        invalidate_dependents({slot});
+        modify(f)->observe(argument, value);
+        for(auto d : _dependents[slot])
+            modify(d)->observe(argument, value);
+        _flock_of[slot]       = argument_map::npos;
+        _belief_cache[slot]   = value ? 1.0 : 0.0;
+        _cache_is_valid[slot] = true;
+        link_flocks();
+    }
+
+    /* Exact for a refinement of the argument: P(a) is the expectation of P(a | c) weighted by P(c) over the
+     * configurations c of the conditioning (not their plain mean), the refinement maps every P(a | c) by the same
+     * affine function and the weights sum to one, so P(a) goes through it too */
+    template<typename S>
+    double basic_distribution<S>::refined_belief(double belief, bool positive, double coefficient) {
+        return positive ? belief + coefficient * (1 - belief) : belief * (1 - coefficient);
+    }
+
+    /* Slots whose belief depends on the changed ones: the marginals of anything not downstream of them stay the same */
+    template<typename S>
+    std::vector<bool> basic_distribution<S>::dependents(std::vector<unsigned int> changed) const {
+        std::vector<bool> dirty(_arguments.size(), false), seen(_flocks.size(), false);
+        while(!changed.empty()) {
+            auto slot = changed.back();
+            changed.pop_back();
+            for(auto f : _dependents[slot])
+                if(!seen[f]) {
+                    seen[f] = true;
+                    for(auto arg : _flocks[f]->conditioned()) {
+                        dirty[_slots.at(arg)] = true;
+                        changed.push_back(_slots.at(arg));
+                    }
+                }
         }
+        return dirty;
+    }
 
-        return combined->marginalize(arguments);
+    template<typename S>
+    void basic_distribution<S>::invalidate_dependents(const std::vector<unsigned int> &changed) {
+        auto dirty = dependents(changed);
+        for(unsigned int slot = 0; slot < dirty.size(); slot++)
+            if(dirty[slot])
+                _cache_is_valid[slot] = false;
     }
 
-    std::string distribution::to_str() const {
+    /* Every change of a flock goes through here: keep it for the checkpoint, detach it from snapshots, new version */
+    template<typename S>
+    basic_flock<S> *basic_distribution<S>::modify(unsigned int f) {
+        if(!_checkpoints.empty()) {
+            auto &saved = _checkpoints.back().flocks;
+            if(std::find_if(saved.cbegin(), saved.cend(), [f](const std::pair<unsigned int, std::shared_ptr<flock_type>> &s) {
+                    return s.first == f;}) == saved.cend())
+                saved.emplace_back(f, _flocks[f]);
+        }
+        /* Published flocks are copied whether or not the snapshot still holds them. Otherwise only another copy of the
+         * distribution or the checkpoint can share it: the fence orders the writes below after the release of their
+         * reference by a thread that has just dropped one, which the use_count() load alone does not. */
+        bool shared = _published_flocks[f] || _flocks[f].use_count() > 1;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(shared) {
+            _flocks[f]           = std::make_shared<flock_type>(*_flocks[f]);
+            _published_flocks[f] = false;
+        }
+        _versions[f] = next_version();
+        return _flocks[f].get();
+    }
+
+    template<typename S>
+    std::uint64_t basic_distribution<S>::next_version() {
+        static std::atomic<std::uint64_t> version(0);
+        return ++version;
+    }
+
+    template<typename S>
+    std::string basic_distribution<S>::to_str() const {
         std::stringstream ss;
         for (auto &f : _flocks)
             ss << f->to_str() << " ";
@@ -111,4 +452,11 @@ namespace splittercell {
         s.pop_back();
         return s;
     }
+
+    template class basic_distribution<double>;
+    template class basic_distribution<float>;
+    template class basic_distribution<log_space<double>>;
+    template class basic_snapshot<double>;
+    template class basic_snapshot<float>;
+    template class basic_snapshot<log_space<double>>;
 }
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include "distribution_batch.h"
+#include "elimination.h"
+#include "gather_plan.h"
+
+namespace splittercell {
+    unsigned int distribution_batch::layout::position(unsigned int argument) const {
+        auto it = std::find(conditioned.cbegin(), conditioned.cend(), argument);
+        if(it != conditioned.cend())
+            return it - conditioned.cbegin();
+        it = std::find(conditioning.cbegin(), conditioning.cend(), argument);
+        return (it == conditioning.cend()) ? gather_plan::dropped : conditioned.size() + (it - conditioning.cbegin());
+    }
+
+    distribution_batch::distribution_batch(const std::vector<std::unique_ptr<flock>> &flocks, unsigned int sessions, std::shared_ptr<executor> exec) :
+            _sessions(sessions), _executor(std::move(exec)), _plan_limit(default_plan_limit) {
+        for(auto &f : flocks) {
+            for(auto arg : f->conditioned()) {
+                if(_flock_of.contains(arg))
+                    throw std::invalid_argument("An argument cannot be in different flocks.");
+                _flock_of.insert(arg, _layouts.size());
+            }
+            _layouts.push_back({f->conditioned(), f->conditioning()});
+            std::vector<double> table((std::size_t(1) << f->size()) * _sessions);
+            f->for_each_model([&](std::size_t i, double v) {std::fill_n(table.begin() + i * _sessions, _sessions, v);});
+            _tables.push_back(std::move(table));
+        }
+    }
+
+    std::vector<double> distribution_batch::probabilities(unsigned int session, unsigned int f) const {
+        std::vector<double> probabilities(std::size_t(1) << _layouts[f].size());
+        for(std::size_t i = 0; i < probabilities.size(); i++)
+            probabilities[i] = _tables[f][i * _sessions + session];
+        return probabilities;
+    }
+
+    void distribution_batch::set_probabilities(unsigned int session, unsigned int f, const std::vector<double> &probabilities) {
+        std::size_t models = std::size_t(1) << _layouts[f].size();
+        if(probabilities.size() < models)
+            throw std::invalid_argument("Not enough probabilities for the flock.");
+        for(std::size_t i = 0; i < models; i++)
+            _tables[f][i * _sessions + session] = probabilities[i];
+    }
+
+    void distribution_batch::refine(unsigned int argument, bool positive, double coefficient) {
+        refine(argument, positive, std::vector<double>(_sessions, coefficient));
+    }
+
+    void distribution_batch::refine(unsigned int argument, bool positive, const std::vector<double> &coefficients) {
+        if(coefficients.size() != _sessions)
+            throw std::invalid_argument("One coefficient per session is needed.");
+        auto f = _flock_of.at(argument);
+        auto index = _layouts[f].position(argument);
+        if(index >= _layouts[f].conditioned.size())
+            throw std::invalid_argument("Only conditioned arguments can be refined.");
+        std::size_t models = std::size_t(1) << _layouts[f].size(), block = std::size_t(1) << index, n = _sessions;
+        double *table = _tables[f].data();
+        const double *c = coefficients.data();
+        for_sessions([=](std::size_t begin, std::size_t end) {
+            for(std::size_t base = 0; base < models; base += 2 * block)
+                for(std::size_t j = base; j < base + block; j++) {
+                    double *lo = table + j * n, *hi = table + (j + block) * n;
+                    double *from = positive ? lo : hi, *to = positive ? hi : lo;
+                    for(std::size_t s = begin; s < end; s++) {
+                        to[s]   += c[s] * from[s];
+                        from[s] *= 1.0 - c[s];
+                    }
+                }
+        });
+    }
+
+    void distribution_batch::set_plan_limit(std::size_t plans) {
+        std::lock_guard<std::mutex> lock(_plans_mutex);
+        _plan_limit = plans;
+        while(_plans.size() > _plan_limit) {
+            _plan_index.erase(_plans.back().first);
+            _plans.pop_back();
+        }
+    }
+
+    std::unordered_map<unsigned int, std::vector<double>> distribution_batch::operator[](const std::vector<unsigned int> &arguments) const {
+        std::set<unsigned int> unique(arguments.cbegin(), arguments.cend());
+        std::vector<unsigned int> key(unique.cbegin(), unique.cend());
+        std::shared_ptr<const plan> p;
+        {
+            std::lock_guard<std::mutex> lock(_plans_mutex);
+            auto it = _plan_index.find(key);
+            if(it != _plan_index.end()) {
+                _plans.splice(_plans.begin(), _plans, it->second);
+                p = it->second->second;
+            } else {
+                p = make_plan(key);
+                _plans.emplace_front(key, p);
+                _plan_index[key] = _plans.begin();
+                while(_plans.size() > _plan_limit) {
+                    _plan_index.erase(_plans.back().first);
+                    _plans.pop_back();
+                }
+            }
+        }
+
+        /* Intermediate factors, every thread only ever touches its own sessions in them */
+        std::size_t n = _sessions;
+        std::vector<std::vector<double>> intermediate(p->factors.size());
+        for(unsigned int id = _layouts.size(); id < p->factors.size(); id++)
+            intermediate[id].assign((std::size_t(1) << p->factors[id].size()) * n, 0.0);
+        auto table = [&](unsigned int id) -> const double* {return (id < _layouts.size()) ? _tables[id].data() : intermediate[id].data();};
+
+        /* The map is not touched by the threads, only the vectors it already holds */
+        std::unordered_map<unsigned int, std::vector<double>> beliefs;
+        std::vector<std::pair<std::size_t, double*>> outputs;
+        for(auto arg : key) {
+            beliefs[arg].assign(n, 0.0);
+            outputs.emplace_back(std::size_t(1) << p->factors[p->result].position(arg), beliefs[arg].data());
+        }
+        const auto &result = p->factors[p->result];
+        for_sessions([&](std::size_t begin, std::size_t end) {
+            for(auto &s : p->steps) {
+                const double *first = table(s.first);
+                double *out = intermediate[s.out].data();
+                if(s.destination.empty()) {
+                    const double *second = table(s.second);
+                    for(std::size_t i = 0; i < s.first_index.size(); i++) {
+                        const double *a = first + s.first_index[i] * n, *b = second + s.second_index[i] * n;
+                        double *o = out + i * n;
+                        for(std::size_t j = begin; j < end; j++)
+                            o[j] = a[j] * b[j];
+                    }
+                } else
+                    for(std::size_t i = 0; i < s.destination.size(); i++) {
+                        const double *a = first + i * n;
+                        double *o = out + s.destination[i] * n;
+                        for(std::size_t j = begin; j < end; j++)
+                            o[j] += a[j];
+                    }
+            }
+
+            const double *joint = table(p->result);
+            for(auto &o : outputs) {
+                std::size_t bit = o.first;
+                double *belief = o.second;
+                for(std::size_t i = 0; i < (std::size_t(1) << result.size()); i++)
+                    if(i & bit)
+                        for(std::size_t j = begin; j < end; j++)
+                            belief[j] += joint[i * n + j];
+            }
+        });
+        return beliefs;
+    }
+
+    /* Same elimination as the single distribution, recorded as index mappings instead of being run */
+    std::shared_ptr<const distribution_batch::plan> distribution_batch::make_plan(const std::vector<unsigned int> &arguments) const {
+        auto p = std::make_shared<plan>();
+        p->factors = _layouts;
+
+        std::set<unsigned int> closure;
+        std::vector<unsigned int> pending(arguments);
+        while(!pending.empty()) {
+            auto f = _flock_of.at(pending.back());
+            pending.pop_back();
+            if(closure.insert(f).second)
+                pending.insert(pending.end(), _layouts[f].conditioning.cbegin(), _layouts[f].conditioning.cend());
+        }
+        std::vector<unsigned int> active(closure.cbegin(), closure.cend());
+
+        auto product = [&p](unsigned int a, unsigned int b) {
+            const layout first = p->factors[a], second = p->factors[b];
+            layout out{first.conditioned, {}};
+            out.conditioned.insert(out.conditioned.end(), second.conditioned.cbegin(), second.conditioned.cend());
+            for(auto arg : first.conditioning)
+                if(second.position(arg) >= second.conditioned.size())
+                    out.conditioning.push_back(arg);
+            for(auto arg : second.conditioning)
+                if(first.position(arg) == gather_plan::dropped)
+                    out.conditioning.push_back(arg);
+
+            step s{a, b, (unsigned int)p->factors.size(), {}, {}, {}};
+            std::vector<unsigned int> tofirst, tosecond;
+            for(auto args : {&out.conditioned, &out.conditioning})
+                for(auto arg : *args) {
+                    tofirst.push_back(first.position(arg));
+                    tosecond.push_back(second.position(arg));
+                }
+            gather_plan gfirst(tofirst), gsecond(tosecond);
+            for(std::size_t i = 0; i < (std::size_t(1) << out.size()); i++) {
+                s.first_index.push_back(gfirst.map(i));
+                s.second_index.push_back(gsecond.map(i));
+            }
+            p->factors.push_back(out);
+            p->steps.push_back(std::move(s));
+            return (unsigned int)p->factors.size() - 1;
+        };
+        auto multiply = [&p, &product](std::vector<unsigned int> &ids) {
+            std::sort(ids.begin(), ids.end(), [&p](unsigned int a, unsigned int b) {
+                return (p->factors[a].size() != p->factors[b].size()) ? p->factors[a].size() < p->factors[b].size() : a < b;
+            });
+            unsigned int result = ids.front();
+            for(auto it = ids.cbegin() + 1; it != ids.cend(); ++it)
+                result = product(result, *it);
+            return result;
+        };
+
+        std::vector<std::vector<unsigned int>> scopes;
+        for(auto f : active) {
+            scopes.push_back(_layouts[f].conditioned);
+            scopes.back().insert(scopes.back().end(), _layouts[f].conditioning.cbegin(), _layouts[f].conditioning.cend());
+        }
+        for(auto argument : elimination::order(scopes, std::set<unsigned int>(arguments.cbegin(), arguments.cend()))) {
+            std::vector<unsigned int> bucket, rest;
+            bool kept = false;
+            for(auto id : active) {
+                if(p->factors[id].position(argument) == gather_plan::dropped) {
+                    rest.push_back(id);
+                    continue;
+                }
+                bucket.push_back(id);
+                for(auto arg : p->factors[id].conditioned)
+                    kept = kept || arg != argument;
+            }
+            if(kept) { //Otherwise what is left sums to one for every configuration of its conditioning, not even multiplied
+                unsigned int source = multiply(bucket);
+                layout out{{}, p->factors[source].conditioning};
+                for(auto arg : p->factors[source].conditioned)
+                    if(arg != argument)
+                        out.conditioned.push_back(arg);
+                std::vector<unsigned int> destination;
+                for(auto args : {&p->factors[source].conditioned, &p->factors[source].conditioning})
+                    for(auto arg : *args)
+                        destination.push_back(out.position(arg));
+                gather_plan g(destination);
+                step s{source, source, (unsigned int)p->factors.size(), {}, {}, {}};
+                for(std::size_t i = 0; i < (std::size_t(1) << p->factors[source].size()); i++)
+                    s.destination.push_back(g.map(i));
+                p->factors.push_back(out);
+                rest.push_back(s.out);
+                p->steps.push_back(std::move(s));
+            }
+            active = std::move(rest);
+        }
+        p->result = multiply(active);
+        return p;
+    }
+
+    void distribution_batch::for_sessions(const std::function<void(std::size_t, std::size_t)> &body) const {
+        if(_executor)
+            _executor->parallel_for(_sessions, cache_line_doubles, body);
+        else
+            thread_pool::shared()->parallel_for(_sessions, cache_line_doubles, body);
+    }
+}
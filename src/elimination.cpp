@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <limits>
+#include "elimination.h"
+#include "stats.h"
+
+namespace {
+    template<typename F>
+    std::vector<unsigned int> scope(const F &f) {
+        std::vector<unsigned int> s(f.conditioned());
+        s.insert(s.end(), f.conditioning().cbegin(), f.conditioning().cend());
+        return s;
+    }
+
+    template<typename F>
+    bool contains(const F &f, unsigned int argument) {
+        return std::find(f.conditioned().cbegin(), f.conditioned().cend(), argument) != f.conditioned().cend() ||
+               std::find(f.conditioning().cbegin(), f.conditioning().cend(), argument) != f.conditioning().cend();
+    }
+}
+
+namespace splittercell {
+    template<typename S>
+    basic_elimination<S>::basic_elimination(const std::vector<const flock_type*> &flocks, executor *exec) :
+            basic_elimination(flocks, std::vector<std::string>(), nullptr, exec) {}
+
+    template<typename S>
+    basic_elimination<S>::basic_elimination(const std::vector<const flock_type*> &flocks, const std::vector<std::string> &signatures,
+                                            basic_factor_cache<S> *cache, executor *exec) :
+            _cache(signatures.empty() ? nullptr : cache), _exec(exec), _peak(0) {
+        for(unsigned int i = 0; i < flocks.size(); i++) {
+            std::shared_ptr<const flock_type> table(std::shared_ptr<const flock_type>(), flocks[i]); //Not owned
+            _factors.push_back({table, signatures.empty() ? std::string() : signatures[i]});
+            _peak = std::max(_peak, flocks[i]->size());
+        }
+    }
+
+    template<typename S>
+    std::vector<unsigned int> basic_elimination<S>::order(const std::vector<std::vector<unsigned int>> &scopes, const std::set<unsigned int> &keep) {
+        /* Interaction graph: two arguments are neighbours when they share a table */
+        std::map<unsigned int, std::set<unsigned int>> neighbours;
+        for(auto &s : scopes)
+            for(auto a : s) {
+                auto &n = neighbours[a];
+                n.insert(s.cbegin(), s.cend());
+                n.erase(a);
+            }
+
+        std::vector<unsigned int> eliminated;
+        while(true) {
+            unsigned int best = 0, best_fill = std::numeric_limits<unsigned int>::max(), best_degree = best_fill;
+            for(auto &candidate : neighbours) {
+                if(keep.count(candidate.first))
+                    continue;
+                unsigned int fill = 0;
+                for(auto a : candidate.second)
+                    for(auto b : candidate.second)
+                        if(a < b && neighbours[a].count(b) == 0)
+                            fill++;
+                if(fill < best_fill || (fill == best_fill && candidate.second.size() < best_degree)) {
+                    best        = candidate.first;
+                    best_fill   = fill;
+                    best_degree = candidate.second.size();
+                }
+            }
+            if(best_fill == std::numeric_limits<unsigned int>::max())
+                return eliminated;
+
+            /* Summing out best connects all its neighbours */
+            auto around = neighbours[best];
+            for(auto a : around) {
+                neighbours[a].erase(best);
+                for(auto b : around)
+                    if(a != b)
+                        neighbours[a].insert(b);
+            }
+            neighbours.erase(best);
+            eliminated.push_back(best);
+        }
+    }
+
+    template<typename S>
+    std::shared_ptr<const basic_flock<S>> basic_elimination<S>::joint(const std::vector<unsigned int> &arguments) {
+        stats::kernel_timer timer(stats::kernel::elimination);
+        std::vector<std::vector<unsigned int>> scopes;
+        for(auto &f : _factors)
+            scopes.push_back(scope(*f.table));
+
+        for(auto argument : order(scopes, std::set<unsigned int>(arguments.cbegin(), arguments.cend()))) {
+            std::vector<factor> bucket, rest;
+            for(auto &f : _factors)
+                (contains(*f.table, argument) ? bucket : rest).push_back(f);
+
+            /* The flock conditioning argument is in the bucket, so argument is conditioned in the product */
+            std::vector<unsigned int> keep;
+            for(auto &f : bucket)
+                std::copy_if(f.table->conditioned().cbegin(), f.table->conditioned().cend(), std::back_inserter(keep),
+                             [argument](unsigned int a){return a != argument;});
+            if(keep.empty()) { //What is left sums to one for every configuration of its conditioning
+                _factors = std::move(rest);
+                continue;
+            }
+
+            auto key = signature(bucket, "-" + std::to_string(argument));
+            auto eliminated = _cache ? _cache->find(key) : nullptr;
+            if(eliminated == nullptr) {
+                auto product = multiply(bucket);
+                keep.clear();
+                std::copy_if(product->conditioned().cbegin(), product->conditioned().cend(), std::back_inserter(keep),
+                             [argument](unsigned int a){return a != argument;});
+                eliminated = product->marginalize(keep, _exec);
+                if(_cache)
+                    _cache->insert(key, eliminated);
+            }
+            rest.push_back({eliminated, key});
+            _factors = std::move(rest);
+        }
+
+        std::string arguments_key = "|";
+        for(auto arg : arguments)
+            arguments_key += std::to_string(arg) + ",";
+        auto key = signature(_factors, arguments_key);
+        auto combined = _cache ? _cache->find(key) : nullptr;
+        if(combined == nullptr) {
+            combined = multiply(_factors)->marginalize(arguments, _exec);
+            if(_cache)
+                _cache->insert(key, combined);
+        }
+        return combined;
+    }
+
+    /* Canonical name of an operation on a set of factors, sorting them also fixes the order they are multiplied in */
+    template<typename S>
+    std::string basic_elimination<S>::signature(std::vector<factor> &factors, const std::string &operation) const {
+        std::sort(factors.begin(), factors.end(), [](const factor &a, const factor &b) {
+            return (a.table->size() != b.table->size()) ? a.table->size() < b.table->size() : a.signature < b.signature;
+        });
+        if(_cache == nullptr)
+            return std::string();
+        std::string s = "(";
+        for(auto &f : factors)
+            s += f.signature + "*";
+        return s + ")" + operation;
+    }
+
+    template<typename S>
+    std::shared_ptr<const basic_flock<S>> basic_elimination<S>::multiply(std::vector<factor> &factors) {
+        auto product = factors.front().table;
+        for(auto it = factors.cbegin() + 1; it != factors.cend(); ++it) {
+            product = product->combine(it->table.get(), _exec);
+            _peak   = std::max(_peak, product->size());
+        }
+        return product;
+    }
+
+    template class basic_elimination<double>;
+    template class basic_elimination<float>;
+    template class basic_elimination<log_space<double>>;
+}
@@ -0,0 +1,74 @@
+#include "factor_cache.h"
+#include "stats.h"
+
+namespace splittercell {
+    template<typename S>
+    const std::size_t basic_factor_cache<S>::default_budget;
+
+    template<typename S>
+    basic_factor_cache<S>::basic_factor_cache(const basic_factor_cache &other) {
+        std::lock_guard<std::mutex> lock(other._mutex);
+        _entries = other._entries;
+        for(auto it = _entries.begin(); it != _entries.end(); ++it)
+            _index[it->key] = it;
+        _budget = other._budget;
+        _bytes  = other._bytes;
+        _hits   = other._hits;
+        _misses = other._misses;
+    }
+
+    template<typename S>
+    std::shared_ptr<const basic_flock<S>> basic_factor_cache<S>::find(const std::string &key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if(it == _index.end()) {
+            _misses++;
+            stats::count(stats::counter::factor_misses);
+            return nullptr;
+        }
+        _hits++;
+        stats::count(stats::counter::factor_hits);
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return it->second->factor;
+    }
+
+    template<typename S>
+    void basic_factor_cache<S>::insert(const std::string &key, std::shared_ptr<const flock_type> f) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::size_t bytes = footprint(*f);
+        if(bytes > _budget || _index.find(key) != _index.end())
+            return;
+        _bytes += bytes;
+        _entries.push_front({key, std::move(f), bytes});
+        _index[key] = _entries.begin();
+        evict();
+    }
+
+    template<typename S>
+    void basic_factor_cache<S>::set_budget(std::size_t budget) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _budget = budget;
+        evict();
+    }
+
+    template<typename S>
+    void basic_factor_cache<S>::clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.clear();
+        _index.clear();
+        _bytes = 0;
+    }
+
+    template<typename S>
+    void basic_factor_cache<S>::evict() {
+        while(_bytes > _budget && !_entries.empty()) {
+            _bytes -= _entries.back().bytes;
+            _index.erase(_entries.back().key);
+            _entries.pop_back();
+        }
+    }
+
+    template class basic_factor_cache<double>;
+    template class basic_factor_cache<float>;
+    template class basic_factor_cache<log_space<double>>;
+}
@@ -1,91 +1,531 @@
 #include <algorithm>
 #include <stdexcept>
-#include <future>
 #include <sstream>
+#include <cmath>
+#include <array>
+#include <functional>
+#include <limits>
 #include "flock.h"
+#include "kernels.h"
+#include "small_kernels.h"
+#include "stats.h"
 
-inline void set_bin_value(unsigned int &end, unsigned int i, unsigned int mask, unsigned int where) {
-      end |= ((bool)(i & (1 << mask)) << where);
+namespace {
+    const unsigned int tile_bits = 11, max_fused_bits = 3;
+
+    /* (lo, hi) <- (a lo + b hi, c lo + d hi) as probabilities */
+    typedef std::array<double, 4> pair_operator;
+
+    pair_operator refinement(bool positive, double coefficient) {
+        if(positive)
+            return {{1.0 - coefficient, 0.0, coefficient, 1.0}};
+        return {{1.0, coefficient, 0.0, 1.0 - coefficient}};
+    }
+
+    /* second after first */
+    pair_operator compose(const pair_operator &second, const pair_operator &first) {
+        return {{second[0] * first[0] + second[1] * first[2], second[0] * first[1] + second[1] * first[3],
+                 second[2] * first[0] + second[3] * first[2], second[2] * first[1] + second[3] * first[3]}};
+    }
+
+    /* Whether every model on one side of the argument becomes impossible */
+    bool empties(const pair_operator &m) {
+        return (m[0] == 0.0 && m[1] == 0.0) || (m[2] == 0.0 && m[3] == 0.0);
+    }
+
+    template<typename traits>
+    std::array<typename traits::value_type, 4> stored(const pair_operator &m) {
+        std::array<typename traits::value_type, 4> s;
+        std::transform(m.cbegin(), m.cend(), s.begin(), traits::from_probability);
+        return s;
+    }
+
+    template<typename traits>
+    void apply(typename traits::value_type *lo, typename traits::value_type *hi, std::size_t size, const std::array<typename traits::value_type, 4> &m) {
+        for(std::size_t j = 0; j < size; j++) {
+            auto l = lo[j], h = hi[j];
+            lo[j] = traits::add(traits::multiply(m[0], l), traits::multiply(m[1], h));
+            hi[j] = traits::add(traits::multiply(m[2], l), traits::multiply(m[3], h));
+        }
+    }
 }
 
 namespace splittercell {
-    flock::flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, const std::vector<double> &distribution) :
-            _conditioned(args), _conditioning(cond), _distribution(distribution), _size(args.size() + cond.size()), _uniform(false) {
-        unsigned int limit = std::numeric_limits<unsigned int>::digits - 2;
-        if(_size > limit)
+    template<typename S>
+    basic_flock<S>::basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, const std::vector<value_type> &distribution) :
+            basic_flock(args, cond, table<value_type>(distribution.cbegin(), distribution.cend()), false) {
+        if(!_uniform)
+            adapt();
+    }
+
+    template<typename S>
+    basic_flock<S>::basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, table<value_type> &&distribution, bool uniform) :
+            _conditioned(args), _conditioning(cond), _distribution(std::move(distribution)), _size(args.size() + cond.size()), _uniform(uniform),
+            _sparse(false) {
+        if(_size > max_flock_arguments)
             throw std::overflow_error("Too many arguments in the flock.");
-        unsigned int num_of_models = (1U << _size);
-        double initial_belief      = 1.0 * (1U << _conditioning.size()) / num_of_models;
+        std::size_t num_of_models = std::size_t(1) << _size;
+        value_type initial_belief = traits::from_probability(std::ldexp(1.0, int(_conditioning.size()) - int(_size)));
         if(_distribution.empty()) {
-            _distribution = std::vector<double>(num_of_models, initial_belief);
+            _distribution.assign(num_of_models, initial_belief);
             _uniform      = true; //If the distribution is not uniform, we cannot cache 0.5 as a belief for the arguments in this flock
         }
 
         map_arguments();
     }
 
-    flock::flock(const flock &other) : _conditioned(other._conditioned), _conditioning(other._conditioning), _distribution(other._distribution),
-                                       _mapping(other._mapping), _size(other._size), _uniform(other._uniform) {}
+    template<typename S>
+    basic_flock<S>::basic_flock(const std::vector<unsigned int> &args, const std::vector<unsigned int> &cond, std::vector<std::size_t> models,
+                                std::vector<value_type> values) :
+            _conditioned(args), _conditioning(cond), _models(std::move(models)), _values(std::move(values)), _size(args.size() + cond.size()),
+            _uniform(false), _sparse(true) {
+        if(_size > max_flock_arguments)
+            throw std::overflow_error("Too many arguments in the flock.");
+        if(_models.size() != _values.size() || std::adjacent_find(_models.cbegin(), _models.cend(), std::greater_equal<std::size_t>()) != _models.cend() ||
+           (!_models.empty() && _models.back() >= (std::size_t(1) << _size)))
+            throw std::invalid_argument("A sparse table needs increasing models of the flock and a value for each.");
+
+        map_arguments();
+        adapt();
+    }
+
+    template<typename S>
+    basic_flock<S>::basic_flock(const basic_flock &other) : _conditioned(other._conditioned), _conditioning(other._conditioning),
+                                       _distribution(other._sparse ? table<value_type>() : other._distribution), _models(other._models),
+                                       _values(other._values), _mapping(other._mapping), _size(other._size), _uniform(other._uniform),
+                                       _sparse(other._sparse) {
+        std::lock_guard<std::mutex> lock(other._plans_mutex);
+        _plans = other._plans;
+    }
 
-    std::string flock::to_str() const {
+    template<typename S>
+    std::string basic_flock<S>::to_str() const {
         std::stringstream ss;
-        for (double val : _distribution) ss << val << " ";
+        for_each_model([&ss](std::size_t, value_type val) {ss << val << " ";});
         std::string s = ss.str();
         s.pop_back();
         return s;
     }
 
-    void flock::refine(unsigned int argument, bool positive, double coefficient) {
-        unsigned int index = _mapping[argument];
-        if(index >= _conditioned.size())
-            throw std::invalid_argument("Only conditioned arguments can be refined.");
-        for (unsigned int i = 0; i < _distribution.size(); i++) {
-            if((bool)(i & (1U << index)) == positive) { //If the model satisfies argument+side of update
-                unsigned int opposite = i ^ (1U << index); //Closest model not satisfying
-                double opposite_val = _distribution[opposite];
-                _distribution[opposite] *= (1U - coefficient);
-                _distribution[i] += coefficient * opposite_val;
+    template<typename S>
+    bool basic_flock<S>::operator==(const basic_flock &other) const {
+        if(_conditioned != other._conditioned || _conditioning != other._conditioning)
+            return false;
+        if(_sparse && other._sparse)
+            return _models == other._models && _values == other._values;
+        if(!_sparse && !other._sparse)
+            return _distribution == other._distribution;
+        const basic_flock &sparse = _sparse ? *this : other, &dense = _sparse ? other : *this;
+        bool equal = true;
+        sparse.for_each_model([&](std::size_t i, value_type v) {equal = equal && v == dense._distribution[i];});
+        return equal;
+    }
+
+    template<typename S>
+    std::size_t basic_flock<S>::table_bytes() const {
+        if(!_sparse)
+            return _distribution.size() * sizeof(value_type);
+        std::lock_guard<std::mutex> lock(_table_mutex);
+        return _models.size() * (sizeof(std::size_t) + sizeof(value_type)) + _distribution.size() * sizeof(value_type);
+    }
+
+    template<typename S>
+    const table<typename basic_flock<S>::value_type> &basic_flock<S>::distribution() const {
+        if(_sparse) {
+            std::lock_guard<std::mutex> lock(_table_mutex);
+            if(_distribution.empty()) {
+                table<value_type> full(std::size_t(1) << _size, traits::zero());
+                for(std::size_t k = 0; k < _models.size(); k++)
+                    full[_models[k]] = _values[k];
+                _distribution.swap(full);
             }
         }
+        return _distribution;
     }
 
-    std::vector<double> flock::marginalized_distribution(const std::vector<unsigned int> &args_to_keep) const {
-        /* New mapping creation (because marginalization put holes in the previous one) */
-        unsigned int index = 0;
-        std::map<unsigned int, unsigned int> mapping;
+    template<typename S>
+    void basic_flock<S>::set_probabilities(const std::vector<value_type> &probabilities) {
+        _distribution.assign(probabilities.cbegin(), probabilities.cend());
+        std::vector<std::size_t>().swap(_models);
+        std::vector<value_type>().swap(_values);
+        _uniform = false;
+        _sparse  = false;
+        adapt();
+    }
+
+    template<typename S>
+    void basic_flock<S>::refine(unsigned int argument, bool positive, double coefficient, executor *exec) {
+        unsigned int index = _mapping.find(argument);
+        if(index == argument_map::npos || index >= _conditioned.size())
+            throw std::invalid_argument("Only conditioned arguments can be refined.");
+        stats::kernel_timer timer(stats::kernel::refine);
+        _uniform = false;
+        if(_sparse) {
+            sparse_apply(index, stored<traits>(refinement(positive, coefficient)));
+            return adapt();
+        }
+
+        std::size_t size = std::size_t(1) << _size, block = std::size_t(1) << index;
+        value_type *distribution = _distribution.data();
+        if(_size <= small::max_streamed_bits)
+            small::by_size<small::max_streamed_bits>::call(_size, [=](auto bits) {
+                small::refine<decltype(bits)::value, traits>(distribution, index, positive, coefficient);});
+        else if(_size < parallel_threshold_bits)
+            traits::refine(distribution, size, index, positive, coefficient);
+        else {
+            /* Work on the size / 2 pairs, chunks are either whole block pairs or slices of a single one */
+            std::size_t grain = std::max(block, cache_line_doubles << 9);
+            perform_mt(exec, size / 2, grain, [=](std::size_t begin, std::size_t end) {
+                if(block <= grain)
+                    return traits::refine(distribution + 2 * begin, 2 * (end - begin), index, positive, coefficient);
+                for(std::size_t pair = begin; pair < end;) {
+                    std::size_t offset = pair % block, length = std::min(block - offset, end - pair);
+                    value_type *lo = distribution + 2 * (pair - offset) + offset;
+                    traits::refine_pairs(lo, lo + block, length, positive, coefficient);
+                    pair += length;
+                }
+            });
+        }
+        if(coefficient == 1.0) //Half of the models are now impossible
+            adapt();
+    }
+
+    template<typename S>
+    void basic_flock<S>::refine_batch(const std::vector<update> &updates, executor *exec) {
+        std::map<unsigned int, pair_operator> operators; //Per index, composed in the order given
+        for(auto &u : updates) {
+            unsigned int index = _mapping.find(u.argument);
+            if(index == argument_map::npos || index >= _conditioned.size())
+                throw std::invalid_argument("Only conditioned arguments can be refined.");
+            auto it = operators.find(index);
+            if(it == operators.end())
+                operators[index] = refinement(u.positive, u.coefficient);
+            else
+                it->second = compose(refinement(u.positive, u.coefficient), it->second);
+        }
+        if(updates.size() == 1)
+            return refine(updates[0].argument, updates[0].positive, updates[0].coefficient, exec);
+        if(operators.empty())
+            return;
+        stats::kernel_timer timer(stats::kernel::refine);
+        _uniform = false;
+        if(_sparse) {
+            for(auto &o : operators)
+                sparse_apply(o.first, stored<traits>(o.second));
+            return adapt();
+        }
+
+        /* Pairs closer than a tile are updated inside it, the others across up to 2^max_fused_bits tiles at once */
+        typedef std::pair<unsigned int, std::array<value_type, 4>> bit_operator;
+        unsigned int tile = std::min(tile_bits, _size);
+        std::vector<bit_operator> near, far;
+        for(auto &o : operators)
+            (o.first < tile ? near : far).push_back({o.first, stored<traits>(o.second)});
+
+        value_type *distribution = _distribution.data();
+        std::size_t tile_size = std::size_t(1) << tile, tiles = std::size_t(1) << (_size - tile);
+        auto pass = [&](const std::vector<bit_operator> &inside, const std::vector<bit_operator> &across) {
+            std::size_t mask = 0;
+            for(auto &o : across)
+                mask |= std::size_t(1) << (o.first - tile);
+            auto body = [&](std::size_t begin, std::size_t end) {
+                value_type *rows[1U << max_fused_bits];
+                unsigned int count = 1U << across.size();
+                for(std::size_t t = begin; t < end; t++) {
+                    if(t & mask) //Visited with its partner tiles
+                        continue;
+                    for(unsigned int r = 0; r < count; r++) {
+                        std::size_t partner = t;
+                        for(unsigned int g = 0; g < across.size(); g++)
+                            if(r & (1U << g))
+                                partner |= std::size_t(1) << (across[g].first - tile);
+                        rows[r] = distribution + (partner << tile);
+                        for(auto &o : inside) {
+                            std::size_t block = std::size_t(1) << o.first;
+                            for(std::size_t base = 0; base < tile_size; base += 2 * block)
+                                apply<traits>(rows[r] + base, rows[r] + base + block, block, o.second);
+                        }
+                    }
+                    for(unsigned int g = 0; g < across.size(); g++)
+                        for(unsigned int r = 0; r < count; r++)
+                            if(!(r & (1U << g)))
+                                apply<traits>(rows[r], rows[r | (1U << g)], tile_size, across[g].second);
+                }
+            };
+            if(_size < parallel_threshold_bits)
+                body(0, tiles);
+            else
+                perform_mt(exec, tiles, 1, body);
+        };
+
+        std::size_t done = 0;
+        do {
+            std::vector<bit_operator> group(far.cbegin() + done, far.cbegin() + std::min<std::size_t>(done + max_fused_bits, far.size()));
+            pass((done == 0) ? near : std::vector<bit_operator>(), group);
+            done += max_fused_bits;
+        } while(done < far.size());
+        if(std::any_of(operators.cbegin(), operators.cend(), [](const std::pair<const unsigned int, pair_operator> &o) {return empties(o.second);}))
+            adapt();
+    }
+
+    /* Each pair of models split by the argument is walked once, in the order of the model without it. Both halves of
+     * the result come out sorted and are merged back. */
+    template<typename S>
+    void basic_flock<S>::sparse_apply(unsigned int index, const std::array<value_type, 4> &m) {
+        typedef std::pair<std::size_t, value_type> entry;
+        std::size_t bit = std::size_t(1) << index, none = std::numeric_limits<std::size_t>::max();
+        std::vector<std::size_t> lo, hi; //Positions of the models without and with the argument
+        for(std::size_t k = 0; k < _models.size(); k++)
+            ((_models[k] & bit) ? hi : lo).push_back(k);
+
+        std::vector<entry> new_lo, new_hi;
+        auto keep = [](std::vector<entry> &out, std::size_t model, value_type v) {
+            if(v != traits::zero())
+                out.emplace_back(model, v);
+        };
+        for(std::size_t l = 0, h = 0; l < lo.size() || h < hi.size();) {
+            std::size_t model_lo = (l < lo.size()) ? _models[lo[l]] : none, model_hi = (h < hi.size()) ? (_models[hi[h]] & ~bit) : none;
+            std::size_t pair = std::min(model_lo, model_hi);
+            value_type vl = (model_lo == pair) ? _values[lo[l++]] : traits::zero(), vh = (model_hi == pair) ? _values[hi[h++]] : traits::zero();
+            keep(new_lo, pair, traits::add(traits::multiply(m[0], vl), traits::multiply(m[1], vh)));
+            keep(new_hi, pair | bit, traits::add(traits::multiply(m[2], vl), traits::multiply(m[3], vh)));
+        }
+
+        std::vector<entry> merged(new_lo.size() + new_hi.size());
+        std::merge(new_lo.cbegin(), new_lo.cend(), new_hi.cbegin(), new_hi.cend(), merged.begin(),
+                   [](const entry &a, const entry &b) {return a.first < b.first;});
+        _models.resize(merged.size());
+        _values.resize(merged.size());
+        for(std::size_t k = 0; k < merged.size(); k++) {
+            _models[k] = merged[k].first;
+            _values[k] = merged[k].second;
+        }
+        _distribution = table<value_type>();
+    }
+
+    template<typename S>
+    table<typename basic_flock<S>::value_type> basic_flock<S>::marginalized_distribution(const std::vector<unsigned int> &args_to_keep, executor *exec) const {
         if(args_to_keep == _conditioned)
             return _distribution;
-        for(unsigned int arg : args_to_keep)
-            if(_mapping.find(arg) != _mapping.end())
-                mapping[_mapping.at(arg)] = index++;
+        stats::kernel_timer timer(stats::kernel::marginalize);
+        if(_size <= small::max_bits) {
+            std::array<unsigned int, small::max_bits> destination;
+            small::masks masks;
+            unsigned int kept = destinations(args_to_keep, destination.data());
+            for(unsigned int b = 0; b < _size; b++)
+                masks[b] = (destination[b] == gather_plan::dropped) ? 0 : 1U << destination[b];
+            table<value_type> distribution(std::size_t(1) << kept, traits::zero());
+            small::by_size<>::call(_size, [&](auto bits) {
+                small::marginalize<decltype(bits)::value, traits>(_distribution.data(), distribution.data(), masks);});
+            return distribution;
+        }
+        auto p = plan(args_to_keep);
+        std::size_t size = std::size_t(1) << _size, marginalized_size = std::size_t(1) << p->destination_bits();
+        table<value_type> distribution(marginalized_size, traits::zero());
+        /* Every chunk reduces into its own table, only worth it when those are small next to the flock */
+        if(_size < parallel_threshold_bits || marginalized_size > (size >> 6)) {
+            p->template marginalize<S>(_distribution.data(), distribution.data());
+            return distribution;
+        }
+
+        std::mutex merge;
+        perform_mt(exec, size, std::max<std::size_t>(p->block(), cache_line_doubles << 9), [&](std::size_t begin, std::size_t end) {
+            std::vector<value_type> partial(marginalized_size, traits::zero());
+            p->template marginalize<S>(_distribution.data(), partial.data(), begin, end);
+            std::lock_guard<std::mutex> lock(merge);
+            traits::accumulate(distribution.data(), partial.data(), marginalized_size);
+        });
+        return distribution;
+    }
+
+    /* New mapping creation (because marginalization put holes in the previous one), cached per set of kept arguments */
+    template<typename S>
+    std::shared_ptr<const gather_plan> basic_flock<S>::plan(const std::vector<unsigned int> &args_to_keep) const {
+        std::lock_guard<std::mutex> lock(_plans_mutex);
+        auto it = _plans.find(args_to_keep);
+        if(it != _plans.end())
+            return it->second;
+
+        std::vector<unsigned int> destination(_size);
+        destinations(args_to_keep, destination.data());
+        if(_plans.size() >= max_cached_plans)
+            _plans.clear();
+        auto p = std::make_shared<const gather_plan>(destination);
+        _plans[args_to_keep] = p;
+        return p;
+    }
+
+    /* Kept arguments in the order given, then the conditioning ones. Returns how many are kept. */
+    template<typename S>
+    unsigned int basic_flock<S>::destinations(const std::vector<unsigned int> &args_to_keep, unsigned int *destination) const {
+        unsigned int index = 0;
+        std::fill_n(destination, _size, gather_plan::dropped);
+        for(unsigned int arg : args_to_keep) {
+            unsigned int position = _mapping.find(arg);
+            if(position != argument_map::npos && destination[position] == gather_plan::dropped)
+                destination[position] = index++;
+        }
         for(unsigned int arg : _conditioning)
-            if(_mapping.find(arg) != _mapping.end() && mapping.find(_mapping.at(arg)) == mapping.cend())
-                mapping[_mapping.at(arg)] = index++;
+            if(destination[_mapping.at(arg)] == gather_plan::dropped)
+                destination[_mapping.at(arg)] = index++;
+        return index;
+    }
 
-        /* Actual marginalization */
-        unsigned int marginalized_size = (unsigned int)(1U << mapping.size());
-        auto distribution = std::vector<double>(marginalized_size, 0.0);
-        for(unsigned int i = 0; i < _distribution.size(); i++) {
-            unsigned int end = 0;
-            for(auto map : mapping)
-                set_bin_value(end, i, map.first, map.second);
-            distribution[end] += _distribution[i];
+    /* Sum of the table where each argument holds, indexed like the arguments (conditioned first, then conditioning) */
+    template<typename S>
+    std::vector<double> basic_flock<S>::all_marginals(executor *exec) const {
+        stats::kernel_timer timer(stats::kernel::marginals);
+        std::vector<value_type> marginals(_size, traits::zero());
+        std::size_t size = std::size_t(1) << _size;
+        if(_sparse) {
+            for(std::size_t k = 0; k < _models.size(); k++)
+                for(unsigned int b = 0; b < _size; b++)
+                    if(_models[k] & (std::size_t(1) << b))
+                        marginals[b] = traits::add(marginals[b], _values[k]);
+        } else if(_size <= small::max_streamed_bits)
+            small::by_size<small::max_streamed_bits>::call(_size, [&](auto bits) {
+                small::marginals<decltype(bits)::value, traits>(_distribution.data(), marginals.data());});
+        else if(_size < parallel_threshold_bits)
+            traits::marginals(_distribution.data(), _size, marginals.data(), 0, size);
+        else {
+            std::mutex merge;
+            perform_mt(exec, size, cache_line_doubles << 9, [&](std::size_t begin, std::size_t end) {
+                std::vector<value_type> partial(_size, traits::zero());
+                traits::marginals(_distribution.data(), _size, partial.data(), begin, end);
+                std::lock_guard<std::mutex> lock(merge);
+                traits::accumulate(marginals.data(), partial.data(), _size);
+            });
         }
 
-        return distribution;
+        std::vector<double> probabilities(_size);
+        std::transform(marginals.cbegin(), marginals.cend(), probabilities.begin(), traits::to_probability);
+        return probabilities;
+    }
+
+    template<typename S>
+    void basic_flock<S>::possible_models(std::vector<std::size_t> &models, std::vector<double> &probabilities) const {
+        models.clear();
+        probabilities.clear();
+        if(_sparse) {
+            models = _models;
+            probabilities.resize(_values.size());
+            std::transform(_values.cbegin(), _values.cend(), probabilities.begin(), traits::to_probability);
+        } else
+            for(std::size_t i = 0; i < _distribution.size(); i++)
+                if(_distribution[i] != traits::zero()) {
+                    models.push_back(i);
+                    probabilities.push_back(traits::to_probability(_distribution[i]));
+                }
     }
 
-    std::unique_ptr<flock> flock::marginalize(const std::vector<unsigned int> &args_to_keep) const {
-        return std::make_unique<flock>(args_to_keep, _conditioning, marginalized_distribution(args_to_keep));
+    template<typename S>
+    void basic_flock<S>::observe(unsigned int argument, bool value) {
+        unsigned int index = _mapping.find(argument);
+        if(index == argument_map::npos)
+            throw std::invalid_argument("Only arguments of the flock can be observed.");
+        if(index < _conditioned.size()) {
+            /* Same as refining it with a coefficient of 1 and slicing: the mass of every pair of models ends up in the
+             * kept one, so the rest of the flock keeps its marginals in every configuration of the conditioning */
+            std::vector<unsigned int> rest;
+            std::copy_if(_conditioned.cbegin(), _conditioned.cend(), std::back_inserter(rest), [argument](unsigned int a){return a != argument;});
+            if(!rest.empty())
+                marginalize_self(rest);
+            else { //Nothing left to hold a belief in
+                _conditioned.clear();
+                _conditioning.clear();
+                _size   = 0;
+                _sparse = false;
+                std::vector<std::size_t>().swap(_models);
+                std::vector<value_type>().swap(_values);
+                _distribution = table<value_type>(1, traits::from_probability(1.0));
+            }
+        } else {
+            /* Only the configurations of the conditioning with the value are left, each block sums to one already */
+            std::size_t low = (std::size_t(1) << index) - 1;
+            if(!_sparse) {
+                std::size_t half = std::size_t(1) << (_size - 1);
+                table<value_type> sliced(half);
+                for(std::size_t i = 0; i < half; i++)
+                    sliced[i] = _distribution[((i & ~low) << 1) | (std::size_t(value) << index) | (i & low)];
+                _distribution = std::move(sliced);
+            } else {
+                std::vector<std::size_t> models;
+                std::vector<value_type> values;
+                for(std::size_t k = 0; k < _models.size(); k++)
+                    if(((_models[k] >> index) & 1) == value) {
+                        models.push_back(((_models[k] >> 1) & ~low) | (_models[k] & low));
+                        values.push_back(_values[k]);
+                    }
+                _models.swap(models);
+                _values.swap(values);
+                _distribution = table<value_type>();
+            }
+            _conditioning.erase(std::find(_conditioning.begin(), _conditioning.end(), argument));
+            _size--;
+        }
+        _plans.clear();
+        map_arguments();
+        adapt();
+    }
+
+    template<typename S>
+    std::unique_ptr<basic_flock<S>> basic_flock<S>::marginalize(const std::vector<unsigned int> &args_to_keep, executor *exec) const {
+        if(_sparse) {
+            std::vector<std::size_t> models;
+            std::vector<value_type> values;
+            sparse_marginalized(args_to_keep, models, values);
+            return std::unique_ptr<basic_flock>(new basic_flock(args_to_keep, _conditioning, std::move(models), std::move(values)));
+        }
+        return std::unique_ptr<basic_flock>(new basic_flock(args_to_keep, _conditioning, marginalized_distribution(args_to_keep, exec), false));
     }
 
-    void flock::marginalize_self(const std::vector<unsigned int> &args_to_keep) {
+    template<typename S>
+    void basic_flock<S>::marginalize_self(const std::vector<unsigned int> &args_to_keep, executor *exec) {
+        if(_sparse) {
+            std::vector<std::size_t> models;
+            std::vector<value_type> values;
+            sparse_marginalized(args_to_keep, models, values);
+            _models.swap(models);
+            _values.swap(values);
+            _distribution = table<value_type>();
+        } else
+            _distribution = marginalized_distribution(args_to_keep, exec);
         _conditioned  = args_to_keep;
-        _distribution = marginalized_distribution(args_to_keep);
+        _size         = _conditioned.size() + _conditioning.size();
+        _plans.clear();
         map_arguments();
+        if(_sparse)
+            adapt();
     }
 
-    std::unique_ptr<flock> flock::combine(const flock * const f, bool mt) const {
+    template<typename S>
+    void basic_flock<S>::sparse_marginalized(const std::vector<unsigned int> &args_to_keep, std::vector<std::size_t> &models,
+                                             std::vector<value_type> &values) const {
+        stats::kernel_timer timer(stats::kernel::marginalize);
+        auto p = plan(args_to_keep);
+        std::vector<std::pair<std::size_t, value_type>> gathered;
+        gathered.reserve(_models.size());
+        for(std::size_t k = 0; k < _models.size(); k++)
+            gathered.emplace_back(p->map(_models[k]), _values[k]);
+        std::sort(gathered.begin(), gathered.end(), [](const std::pair<std::size_t, value_type> &a, const std::pair<std::size_t, value_type> &b) {
+            return a.first < b.first;});
+        for(auto &g : gathered)
+            if(!models.empty() && models.back() == g.first)
+                values.back() = traits::add(values.back(), g.second);
+            else {
+                models.push_back(g.first);
+                values.push_back(g.second);
+            }
+    }
+
+    template<typename S>
+    std::unique_ptr<basic_flock<S>> basic_flock<S>::combine(const basic_flock * const f, bool mt) const {
+        return combine(f, mt ? nullptr : &no_parallelism());
+    }
+
+    template<typename S>
+    std::unique_ptr<basic_flock<S>> basic_flock<S>::combine(const basic_flock * const f, executor *exec) const {
+        stats::kernel_timer timer(stats::kernel::combine);
         /* Combined flock creation */
         std::vector<unsigned int> conditioned, conditioning;
         conditioned.insert(conditioned.end(), _conditioned.cbegin(), _conditioned.cend());
@@ -94,64 +534,192 @@ namespace splittercell {
         std::copy_if(_conditioning.cbegin(), _conditioning.cend(), std::back_inserter(conditioning),
                      [f](unsigned int i){return std::find(f->_conditioned.cbegin(), f->_conditioned.cend(), i) == f->_conditioned.cend();});
         std::copy_if(f->_conditioning.cbegin(), f->_conditioning.cend(), std::back_inserter(conditioning),
-                     [this](unsigned int i){return std::find(this->_conditioned.cbegin(), this->_conditioned.cend(), i) == this->_conditioned.cend();});
-        auto combinedflock = std::make_unique<flock>(conditioned, conditioning);
-        unsigned int limit = std::numeric_limits<unsigned int>::digits - 2;
-        if(combinedflock->size() > limit)
+                     [this](unsigned int i){return std::find(this->_conditioned.cbegin(), this->_conditioned.cend(), i) == this->_conditioned.cend() &&
+                                                   std::find(this->_conditioning.cbegin(), this->_conditioning.cend(), i) == this->_conditioning.cend();});
+        if(conditioned.size() + conditioning.size() > max_flock_arguments)
             throw std::overflow_error("Too many arguments in the final combined flock.");
+        if(_sparse || f->_sparse)
+            return sparse_combine(f, conditioned, conditioning);
+        /* Every model of the product is written below */
+        std::unique_ptr<basic_flock> combinedflock(new basic_flock(conditioned, conditioning,
+                                                                   table<value_type>(std::size_t(1) << (conditioned.size() + conditioning.size())), false));
+        stats::count(stats::counter::combines);
+        stats::count(stats::counter::combined_models, combinedflock->distribution().size());
+        stats::maximum(stats::counter::largest_combined, combinedflock->size());
+
+        if(combinedflock->size() <= small::max_bits) {
+            small::masks toself, toother;
+            for(auto args : {&conditioned, &conditioning})
+                for(auto arg : *args) {
+                    unsigned int j = combinedflock->_mapping.at(arg), s = _mapping.find(arg), o = f->_mapping.find(arg);
+                    toself[j]  = (s == argument_map::npos) ? 0 : 1U << s;
+                    toother[j] = (o == argument_map::npos) ? 0 : 1U << o;
+                }
+            small::by_size<>::call(combinedflock->size(), [&](auto bits) {
+                small::multiply<decltype(bits)::value, traits>(_distribution.data(), f->_distribution.data(), combinedflock->_distribution.data(),
+                                                               toself, toother);});
+        } else {
+            /* Mapping between combined flock indexes and split flock index */
+            std::vector<unsigned int> toself(combinedflock->size(), gather_plan::dropped), toother(combinedflock->size(), gather_plan::dropped);
+            for(auto args : {&conditioned, &conditioning})
+                for(auto arg : *args) {
+                    toself[combinedflock->_mapping.at(arg)]  = _mapping.find(arg); //npos is gather_plan::dropped
+                    toother[combinedflock->_mapping.at(arg)] = f->_mapping.find(arg);
+                }
+            product_plan plan(toself, toother);
 
-        /* Mapping between combined flock indexes and split flock index */
-        conditioned.insert(conditioned.end(), conditioning.cbegin(), conditioning.cend()); //Just to have the whole set of arguments
-        std::vector<std::pair<unsigned int, unsigned int>> splitindex;
-        splitindex.resize(conditioned.size());
-        for(auto arg : conditioned) {
-            auto itindexself = _mapping.find(arg);
-            unsigned int indexself = (itindexself == _mapping.end()) ? 0 : itindexself->second + 1; //Careful, mandatory to keep unsigned
-            auto itindexother = f->_mapping.find(arg);
-            unsigned int indexother = (itindexother == f->_mapping.end()) ? 0 : itindexother->second + 1; //Careful
-            splitindex[combinedflock->_mapping[arg]] = std::make_pair<>(indexself, indexother);
-        }
-
-        auto combinedptr = combinedflock.get();
-        if(combinedflock->size() < 15 || !mt)
-            mt_combine(combinedptr, f, splitindex, 0, combinedflock->distribution().size());
-        else
-            perform_mt(combinedflock->distribution().size(), std::bind(&flock::mt_combine, this, std::cref(combinedptr),
-                                                             std::cref(f), std::cref(splitindex), std::placeholders::_1, std::placeholders::_2));
+            auto combinedptr = combinedflock.get();
+            if(combinedflock->size() < parallel_threshold_bits)
+                mt_combine(combinedptr, f, plan, 0, plan.blocks());
+            else
+                perform_mt(exec, plan.blocks(), 1, std::bind(&basic_flock::mt_combine, this, std::cref(combinedptr),
+                                                             std::cref(f), std::cref(plan), std::placeholders::_1, std::placeholders::_2));
+        }
+        combinedflock->_uniform = _uniform && f->_uniform;
 
         return combinedflock;
     }
 
-    void flock::mt_combine(flock * const combinedflock, const flock * const f, const std::vector<std::pair<unsigned int, unsigned int>> &splitindex, unsigned int startindex, unsigned int endindex) const {
-        for(unsigned int i = startindex; i < endindex; i++) {
-            unsigned int end1 = 0, end2 = 0;
-            for(unsigned int j = 0; j < combinedflock->size(); j++) {
-                auto indexes = splitindex[j];
-                if(indexes.first != 0)
-                    set_bin_value(end1, i, j, indexes.first-1); //-1 because +1 above
-                if(indexes.second != 0)
-                    set_bin_value(end2, i, j, indexes.second-1); //-1 because +1 above
+    /* Join of the possible models of both sides on their shared arguments, a full side only contributes its possible
+     * models too. Models are scattered to their place in the product first, so the join key is a mask of the result. */
+    template<typename S>
+    std::unique_ptr<basic_flock<S>> basic_flock<S>::sparse_combine(const basic_flock * const f, const std::vector<unsigned int> &conditioned,
+                                                                   const std::vector<unsigned int> &conditioning) const {
+        struct entry {
+            std::size_t key, model;
+            value_type value;
+        };
+        std::vector<unsigned int> all(conditioned);
+        all.insert(all.end(), conditioning.cbegin(), conditioning.cend());
+        std::size_t shared = 0;
+        for(unsigned int b = 0; b < all.size(); b++)
+            if(_mapping.contains(all[b]) && f->_mapping.contains(all[b]))
+                shared |= std::size_t(1) << b;
+
+        auto entries = [&all, shared](const basic_flock *from) {
+            std::vector<unsigned int> destination(from->_size);
+            for(unsigned int b = 0; b < all.size(); b++)
+                if(from->_mapping.contains(all[b]))
+                    destination[from->_mapping.at(all[b])] = b;
+            gather_plan scatter(destination);
+            std::vector<entry> e;
+            auto add = [&](std::size_t model, value_type v) {
+                std::size_t m = scatter.map(model);
+                e.push_back({m & shared, m, v});
+            };
+            if(from->_sparse)
+                for(std::size_t k = 0; k < from->_models.size(); k++)
+                    add(from->_models[k], from->_values[k]);
+            else
+                for(std::size_t i = 0; i < from->_distribution.size(); i++)
+                    if(from->_distribution[i] != traits::zero())
+                        add(i, from->_distribution[i]);
+            std::sort(e.begin(), e.end(), [](const entry &a, const entry &b) {return a.key < b.key;});
+            return e;
+        };
+        auto left = entries(this), right = entries(f);
+
+        std::vector<std::pair<std::size_t, value_type>> product;
+        for(std::size_t l = 0, r = 0; l < left.size() && r < right.size();) {
+            if(left[l].key < right[r].key)
+                l++;
+            else if(right[r].key < left[l].key)
+                r++;
+            else {
+                std::size_t l_end = l, r_end = r;
+                while(l_end < left.size() && left[l_end].key == left[l].key)
+                    l_end++;
+                while(r_end < right.size() && right[r_end].key == right[r].key)
+                    r_end++;
+                for(std::size_t i = l; i < l_end; i++)
+                    for(std::size_t j = r; j < r_end; j++) {
+                        value_type v = traits::multiply(left[i].value, right[j].value);
+                        if(v != traits::zero())
+                            product.emplace_back(left[i].model | right[j].model, v);
+                    }
+                l = l_end;
+                r = r_end;
             }
-            combinedflock->_distribution[i] = _distribution[end1] * f->_distribution[end2];
         }
+        std::sort(product.begin(), product.end(), [](const std::pair<std::size_t, value_type> &a, const std::pair<std::size_t, value_type> &b) {
+            return a.first < b.first;});
+        stats::count(stats::counter::combines);
+        stats::count(stats::counter::combined_models, product.size());
+        stats::maximum(stats::counter::largest_combined, all.size());
+
+        std::vector<std::size_t> models(product.size());
+        std::vector<value_type> values(product.size());
+        for(std::size_t k = 0; k < product.size(); k++) {
+            models[k] = product[k].first;
+            values[k] = product[k].second;
+        }
+        return std::unique_ptr<basic_flock>(new basic_flock(conditioned, conditioning, std::move(models), std::move(values)));
     }
 
-    void flock::perform_mt(unsigned int bound, std::function<void(unsigned int, unsigned int)> t) const {
-        unsigned int numThreads = std::thread::hardware_concurrency();
-        unsigned int range = bound / numThreads;
-        std::vector<std::future<void>> futures;
-        for(unsigned int i = 0; i < numThreads; i++)
-            futures.push_back(std::async(std::launch::async, t, i * range, (i + 1) * range));
-        for(auto &f : futures)
-          f.get();
+    template<typename S>
+    void basic_flock<S>::mt_combine(basic_flock * const combinedflock, const basic_flock * const f, const product_plan &plan,
+                                    std::size_t startblock, std::size_t endblock) const {
+        plan.template multiply<S>(_distribution.data(), f->_distribution.data(), combinedflock->_distribution.data(), startblock, endblock);
+    }
+
+    template<typename S>
+    void basic_flock<S>::perform_mt(executor *exec, std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &t) const {
+        if(exec != nullptr)
+            return exec->parallel_for(bound, grain, t);
+        thread_pool::shared()->parallel_for(bound, grain, t);
     }
 
     /* Mapping argument <-> index to be (somewhat) order agnostic, except conditioned first, then conditioning */
-    void flock::map_arguments() {
-        unsigned int index = 0;
+    template<typename S>
+    void basic_flock<S>::map_arguments() {
+        unsigned int index = 0, largest = 0;
+        _mapping.clear();
+        for(auto args : {&_conditioned, &_conditioning})
+            for(unsigned int arg : *args)
+                largest = std::max(largest, arg);
+        _mapping.reserve(_size, largest);
         for(unsigned int arg : _conditioned)
-            _mapping[arg] = index++;
+            _mapping.insert(arg, index++);
         for(unsigned int arg : _conditioning)
-            _mapping[arg] = index++;
+            _mapping.insert(arg, index++);
+    }
+
+    /* Only where impossible models can have been made, counting them is a pass over the table */
+    template<typename S>
+    void basic_flock<S>::adapt() {
+        std::size_t models = std::size_t(1) << _size;
+        if(_sparse) {
+            if(_size < min_sparse_bits || _models.size() > models / dense_fill)
+                make_dense();
+        } else if(_size >= min_sparse_bits && _distribution.size() == models) {
+            std::size_t possible = std::count_if(_distribution.cbegin(), _distribution.cend(), [](value_type v) {return v != traits::zero();});
+            if(possible <= models / sparse_fill)
+                make_sparse();
+        }
     }
+
+    template<typename S>
+    void basic_flock<S>::make_sparse() {
+        _models.clear();
+        _values.clear();
+        for(std::size_t i = 0; i < _distribution.size(); i++)
+            if(_distribution[i] != traits::zero()) {
+                _models.push_back(i);
+                _values.push_back(_distribution[i]);
+            }
+        _distribution = table<value_type>();
+        _sparse       = true;
+    }
+
+    template<typename S>
+    void basic_flock<S>::make_dense() {
+        distribution();
+        std::vector<std::size_t>().swap(_models);
+        std::vector<value_type>().swap(_values);
+        _sparse = false;
+    }
+
+    template class basic_flock<double>;
+    template class basic_flock<float>;
+    template class basic_flock<log_space<double>>;
 }
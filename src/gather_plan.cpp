@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cstdint>
+#include "gather_plan.h"
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPLITTERCELL_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+#ifdef SPLITTERCELL_X86
+    template<typename S, typename T>
+    __attribute__((target("bmi2")))
+    void scatter_pext(const T *src, T *dst, std::size_t begin, std::size_t end, std::uint64_t mask) {
+        for(std::size_t i = begin; i < end; i++) {
+#ifdef __x86_64__
+            std::size_t m = _pext_u64(i, mask);
+#else
+            std::size_t m = _pext_u32(i, mask);
+#endif
+            dst[m] = splittercell::scalar_traits<S>::add(dst[m], src[i]);
+        }
+    }
+#endif
+}
+
+namespace splittercell {
+    const unsigned int gather_plan::dropped;
+    const unsigned int product_plan::max_block_bits;
+
+    gather_plan::gather_plan(const std::vector<unsigned int> &destination) : _destination(destination), _destination_bits(0),
+                                                                           _low_dropped(0), _low_identity(0), _pext_mask(0), _ordered(true) {
+        unsigned int next = 0;
+        for(unsigned int b = 0; b < _destination.size(); b++)
+            if(_destination[b] != dropped) {
+                _destination_bits++;
+                _pext_mask |= std::uint64_t(1) << b;
+                _ordered = _ordered && (_destination[b] == next++);
+            }
+        while(_low_dropped < _destination.size() && _destination[_low_dropped] == dropped)
+            _low_dropped++;
+        while(_low_identity < _destination.size() && _destination[_low_identity] == _low_identity)
+            _low_identity++;
+
+        /* One table per byte of the source index, the last one only as large as the bits left */
+        for(unsigned int first = 0; first < _destination.size(); first += 8) {
+            std::array<std::size_t, 256> table{};
+            unsigned int bits = std::min(8U, (unsigned int)_destination.size() - first);
+            for(unsigned int value = 0; value < (1U << bits); value++)
+                for(unsigned int b = 0; b < bits; b++)
+                    if((value & (1U << b)) && _destination[first + b] != dropped)
+                        table[value] |= std::size_t(1) << _destination[first + b];
+            _tables.push_back(table);
+        }
+    }
+
+    template<typename S>
+    void gather_plan::marginalize(const typename scalar_traits<S>::value_type *src, typename scalar_traits<S>::value_type *dst) const {
+        marginalize<S>(src, dst, 0, std::size_t(1) << _destination.size());
+    }
+
+    template<typename S>
+    void gather_plan::marginalize(const typename scalar_traits<S>::value_type *src, typename scalar_traits<S>::value_type *dst,
+                                  std::size_t begin, std::size_t end) const {
+        typedef scalar_traits<S> traits;
+        if(_low_dropped >= min_block_bits) { //Contiguous blocks collapse on a single model
+            std::size_t block = std::size_t(1) << _low_dropped;
+            for(std::size_t i = begin; i < end; i += block) {
+                std::size_t m = map(i);
+                dst[m] = traits::add(dst[m], traits::sum(src + i, block));
+            }
+        } else if(_low_identity >= min_block_bits) { //Contiguous rows land on contiguous rows
+            std::size_t row = std::size_t(1) << _low_identity;
+            for(std::size_t i = begin; i < end; i += row)
+                traits::accumulate(dst + map(i), src + i, row);
+        }
+#ifdef SPLITTERCELL_X86
+        else if(_ordered && kernels::has_bmi2())
+            scatter_pext<S>(src, dst, begin, end, _pext_mask);
+#endif
+        else
+            for(std::size_t i = begin; i < end; i++) {
+                std::size_t m = map(i);
+                dst[m] = traits::add(dst[m], src[i]);
+            }
+    }
+
+    product_plan::product_plan(const std::vector<unsigned int> &first, const std::vector<unsigned int> &second) :
+            _first(first), _second(second), _bits(first.size()), _block_bits(0), _layout(layout::gathered) {
+        unsigned int runs_first = 0, runs_second = 0;
+        while(runs_first < _bits && first[runs_first] == runs_first && second[runs_first] == gather_plan::dropped)
+            runs_first++;
+        while(runs_second < _bits && second[runs_second] == runs_second && first[runs_second] == gather_plan::dropped)
+            runs_second++;
+
+        if(std::max(runs_first, runs_second) >= min_block_bits) {
+            _layout     = (runs_first >= runs_second) ? layout::first_runs : layout::second_runs;
+            _block_bits = std::min(std::max(runs_first, runs_second), max_block_bits);
+        } else {
+            _block_bits = std::min(_bits, 10U);
+            for(unsigned int l = 0; l < (1U << _block_bits); l++) {
+                _low_first.push_back(_first.map(l));
+                _low_second.push_back(_second.map(l));
+            }
+        }
+    }
+
+    template<typename S>
+    void product_plan::multiply(const typename scalar_traits<S>::value_type *a, const typename scalar_traits<S>::value_type *b,
+                                typename scalar_traits<S>::value_type *out, std::size_t begin, std::size_t end) const {
+        typedef scalar_traits<S> traits;
+        std::size_t block = std::size_t(1) << _block_bits;
+        for(std::size_t h = begin; h < end; h++) {
+            std::size_t i = h << _block_bits, base1 = _first.map(i), base2 = _second.map(i);
+            auto dst = out + i;
+            switch(_layout) {
+                case layout::first_runs:  traits::scale(dst, a + base1, b[base2], block); break;
+                case layout::second_runs: traits::scale(dst, b + base2, a[base1], block); break;
+                default:
+                    for(std::size_t l = 0; l < block; l++)
+                        dst[l] = traits::multiply(a[base1 | _low_first[l]], b[base2 | _low_second[l]]);
+            }
+        }
+    }
+
+    /* The scalars flocks are instantiated for */
+    template void gather_plan::marginalize<double>(const double *, double *) const;
+    template void gather_plan::marginalize<double>(const double *, double *, std::size_t, std::size_t) const;
+    template void product_plan::multiply<double>(const double *, const double *, double *, std::size_t, std::size_t) const;
+    template void gather_plan::marginalize<float>(const float *, float *) const;
+    template void gather_plan::marginalize<float>(const float *, float *, std::size_t, std::size_t) const;
+    template void product_plan::multiply<float>(const float *, const float *, float *, std::size_t, std::size_t) const;
+    template void gather_plan::marginalize<log_space<double>>(const double *, double *) const;
+    template void gather_plan::marginalize<log_space<double>>(const double *, double *, std::size_t, std::size_t) const;
+    template void product_plan::multiply<log_space<double>>(const double *, const double *, double *, std::size_t, std::size_t) const;
+}
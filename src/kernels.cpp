@@ -0,0 +1,373 @@
+#include <vector>
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPLITTERCELL_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+    using splittercell::kernels::isa;
+
+    /* Pair of blocks (from, to): to += coefficient * from, from *= 1 - coefficient */
+    template<typename T>
+    void refine_pair_scalar(T *from, T *to, std::size_t size, T coefficient, T keep) {
+        for(std::size_t j = 0; j < size; j++) {
+            to[j]   += coefficient * from[j];
+            from[j] *= keep;
+        }
+    }
+
+    /* dst[j] = src[j] + src[j + half], returns the sum of the upper half. dst may be src. */
+    template<typename T>
+    T fold_scalar(const T *src, T *dst, std::size_t half) {
+        T upper = 0;
+        for(std::size_t j = 0; j < half; j++) {
+            upper += src[j + half];
+            dst[j] = src[j] + src[j + half];
+        }
+        return upper;
+    }
+
+    template<typename T>
+    T sum_scalar(const T *src, std::size_t size) {
+        T total = 0;
+        for(std::size_t j = 0; j < size; j++)
+            total += src[j];
+        return total;
+    }
+
+    template<typename T>
+    void accumulate_scalar(T *dst, const T *src, std::size_t size) {
+        for(std::size_t j = 0; j < size; j++)
+            dst[j] += src[j];
+    }
+
+    template<typename T>
+    void scale_scalar(T *dst, const T *src, T factor, std::size_t size) {
+        for(std::size_t j = 0; j < size; j++)
+            dst[j] = src[j] * factor;
+    }
+
+#ifdef SPLITTERCELL_X86
+    /* The few vector operations the kernels need, per instruction set and scalar type */
+    template<typename T> struct sse2_ops;
+    template<typename T> struct avx2_ops;
+
+    template<> struct sse2_ops<double> {
+        typedef __m128d reg;
+        static const std::size_t width = 2;
+        __attribute__((target("sse2"))) static reg set1(double v) {return _mm_set1_pd(v);}
+        __attribute__((target("sse2"))) static reg load(const double *p) {return _mm_loadu_pd(p);}
+        __attribute__((target("sse2"))) static void store(double *p, reg v) {_mm_storeu_pd(p, v);}
+        __attribute__((target("sse2"))) static reg add(reg a, reg b) {return _mm_add_pd(a, b);}
+        __attribute__((target("sse2"))) static reg mul(reg a, reg b) {return _mm_mul_pd(a, b);}
+    };
+
+    template<> struct sse2_ops<float> {
+        typedef __m128 reg;
+        static const std::size_t width = 4;
+        __attribute__((target("sse2"))) static reg set1(float v) {return _mm_set1_ps(v);}
+        __attribute__((target("sse2"))) static reg load(const float *p) {return _mm_loadu_ps(p);}
+        __attribute__((target("sse2"))) static void store(float *p, reg v) {_mm_storeu_ps(p, v);}
+        __attribute__((target("sse2"))) static reg add(reg a, reg b) {return _mm_add_ps(a, b);}
+        __attribute__((target("sse2"))) static reg mul(reg a, reg b) {return _mm_mul_ps(a, b);}
+    };
+
+    template<> struct avx2_ops<double> {
+        typedef __m256d reg;
+        static const std::size_t width = 4;
+        __attribute__((target("avx2"))) static reg zero() {return _mm256_setzero_pd();}
+        __attribute__((target("avx2"))) static reg set1(double v) {return _mm256_set1_pd(v);}
+        __attribute__((target("avx2"))) static reg load(const double *p) {return _mm256_loadu_pd(p);}
+        __attribute__((target("avx2"))) static void store(double *p, reg v) {_mm256_storeu_pd(p, v);}
+        __attribute__((target("avx2"))) static reg add(reg a, reg b) {return _mm256_add_pd(a, b);}
+        __attribute__((target("avx2"))) static reg mul(reg a, reg b) {return _mm256_mul_pd(a, b);}
+        __attribute__((target("avx2"))) static double total(reg v) {
+            double lanes[4];
+            _mm256_storeu_pd(lanes, v);
+            return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        }
+    };
+
+    template<> struct avx2_ops<float> {
+        typedef __m256 reg;
+        static const std::size_t width = 8;
+        __attribute__((target("avx2"))) static reg zero() {return _mm256_setzero_ps();}
+        __attribute__((target("avx2"))) static reg set1(float v) {return _mm256_set1_ps(v);}
+        __attribute__((target("avx2"))) static reg load(const float *p) {return _mm256_loadu_ps(p);}
+        __attribute__((target("avx2"))) static void store(float *p, reg v) {_mm256_storeu_ps(p, v);}
+        __attribute__((target("avx2"))) static reg add(reg a, reg b) {return _mm256_add_ps(a, b);}
+        __attribute__((target("avx2"))) static reg mul(reg a, reg b) {return _mm256_mul_ps(a, b);}
+        __attribute__((target("avx2"))) static float total(reg v) {
+            float lanes[8];
+            _mm256_storeu_ps(lanes, v);
+            return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        }
+    };
+
+    template<typename T>
+    __attribute__((target("sse2")))
+    void refine_pair_sse2(T *from, T *to, std::size_t size, T coefficient, T keep) {
+        typedef sse2_ops<T> v;
+        auto c = v::set1(coefficient), k = v::set1(keep);
+        std::size_t j = 0;
+        for(; j + v::width <= size; j += v::width) {
+            auto f = v::load(from + j);
+            v::store(to + j, v::add(v::load(to + j), v::mul(c, f)));
+            v::store(from + j, v::mul(f, k));
+        }
+        refine_pair_scalar(from + j, to + j, size - j, coefficient, keep);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2")))
+    void refine_pair_avx2(T *from, T *to, std::size_t size, T coefficient, T keep) {
+        typedef avx2_ops<T> v;
+        auto c = v::set1(coefficient), k = v::set1(keep);
+        std::size_t j = 0;
+        for(; j + v::width <= size; j += v::width) {
+            auto f = v::load(from + j);
+            v::store(to + j, v::add(v::load(to + j), v::mul(c, f)));
+            v::store(from + j, v::mul(f, k));
+        }
+        refine_pair_sse2(from + j, to + j, size - j, coefficient, keep);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2")))
+    T fold_avx2(const T *src, T *dst, std::size_t half) {
+        typedef avx2_ops<T> v;
+        if(half < v::width)
+            return fold_scalar(src, dst, half);
+        auto upper = v::zero();
+        for(std::size_t j = 0; j < half; j += v::width) {
+            auto hi = v::load(src + j + half);
+            upper = v::add(upper, hi);
+            v::store(dst + j, v::add(v::load(src + j), hi));
+        }
+        return v::total(upper);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2")))
+    T sum_avx2(const T *src, std::size_t size) {
+        typedef avx2_ops<T> v;
+        auto acc = v::zero();
+        std::size_t j = 0;
+        for(; j + v::width <= size; j += v::width)
+            acc = v::add(acc, v::load(src + j));
+        return v::total(acc) + sum_scalar(src + j, size - j);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2")))
+    void accumulate_avx2(T *dst, const T *src, std::size_t size) {
+        typedef avx2_ops<T> v;
+        std::size_t j = 0;
+        for(; j + v::width <= size; j += v::width)
+            v::store(dst + j, v::add(v::load(dst + j), v::load(src + j)));
+        accumulate_scalar(dst + j, src + j, size - j);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2")))
+    void scale_avx2(T *dst, const T *src, T factor, std::size_t size) {
+        typedef avx2_ops<T> v;
+        auto f = v::set1(factor);
+        std::size_t j = 0;
+        for(; j + v::width <= size; j += v::width)
+            v::store(dst + j, v::mul(v::load(src + j), f));
+        scale_scalar(dst + j, src + j, factor, size - j);
+    }
+#endif
+
+    isa detect() {
+#ifdef SPLITTERCELL_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return isa::avx2;
+        if(__builtin_cpu_supports("sse2"))
+            return isa::sse2;
+#endif
+        return isa::scalar;
+    }
+
+    bool detect_bmi2() {
+#ifdef SPLITTERCELL_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("bmi2");
+#else
+        return false;
+#endif
+    }
+
+    const isa detected = detect();
+    const bool bmi2    = detect_bmi2();
+    isa active         = detected;
+
+    template<typename T>
+    using pair_kernel = void (*)(T *, T *, std::size_t, T, T);
+
+    template<typename T>
+    pair_kernel<T> refine_pair_kernel() {
+        switch(active) {
+#ifdef SPLITTERCELL_X86
+            case isa::avx2: return refine_pair_avx2<T>;
+            case isa::sse2: return refine_pair_sse2<T>;
+#endif
+            default:        return refine_pair_scalar<T>;
+        }
+    }
+
+    template<typename T, T (*fold)(const T *, T *, std::size_t)>
+    void marginals_with(const T *distribution, unsigned int bits, T *out, std::size_t begin, std::size_t end) {
+        unsigned int chunk_bits = (bits < splittercell::kernels::marginals_chunk_bits) ? bits : splittercell::kernels::marginals_chunk_bits;
+        std::size_t chunk = std::size_t(1) << chunk_bits;
+        std::vector<T> buffer(chunk / 2 + 1);
+        for(std::size_t c = begin / chunk; c < end / chunk; c++) {
+            const T *src = distribution + c * chunk;
+            T total = src[0];
+            if(chunk_bits > 0) {
+                std::size_t half = chunk / 2;
+                out[chunk_bits - 1] += fold(src, buffer.data(), half);
+                for(unsigned int b = chunk_bits - 1; b-- > 0;) {
+                    half /= 2;
+                    out[b] += fold(buffer.data(), buffer.data(), half);
+                }
+                total = buffer[0];
+            }
+            for(std::size_t high = c, b = chunk_bits; high != 0; high >>= 1, b++)
+                if(high & 1U)
+                    out[b] += total;
+        }
+    }
+
+    template<typename T>
+    void refine_any(T *distribution, std::size_t size, unsigned int index, bool positive, double coefficient) {
+        std::size_t block = std::size_t(1) << index;
+        pair_kernel<T> kernel = (block < 2) ? refine_pair_scalar<T> : refine_pair_kernel<T>(); //No vector fits in a block of one
+        T moved = T(coefficient), keep = T(1.0 - coefficient);
+        for(std::size_t base = 0; base < size; base += 2 * block) {
+            T *lo = distribution + base, *hi = lo + block;
+            kernel(positive ? lo : hi, positive ? hi : lo, block, moved, keep);
+        }
+    }
+
+    template<typename T>
+    void refine_pairs_any(T *lo, T *hi, std::size_t size, bool positive, double coefficient) {
+        refine_pair_kernel<T>()(positive ? lo : hi, positive ? hi : lo, size, T(coefficient), T(1.0 - coefficient));
+    }
+
+    template<typename T>
+    void marginals_any(const T *distribution, unsigned int bits, T *out, std::size_t begin, std::size_t end) {
+#ifdef SPLITTERCELL_X86
+        if(active == isa::avx2)
+            return marginals_with<T, fold_avx2<T>>(distribution, bits, out, begin, end);
+#endif
+        marginals_with<T, fold_scalar<T>>(distribution, bits, out, begin, end);
+    }
+
+    template<typename T>
+    T sum_any(const T *src, std::size_t size) {
+#ifdef SPLITTERCELL_X86
+        if(active == isa::avx2)
+            return sum_avx2(src, size);
+#endif
+        return sum_scalar(src, size);
+    }
+
+    template<typename T>
+    void accumulate_any(T *dst, const T *src, std::size_t size) {
+#ifdef SPLITTERCELL_X86
+        if(active == isa::avx2)
+            return accumulate_avx2(dst, src, size);
+#endif
+        accumulate_scalar(dst, src, size);
+    }
+
+    template<typename T>
+    void scale_any(T *dst, const T *src, T factor, std::size_t size) {
+#ifdef SPLITTERCELL_X86
+        if(active == isa::avx2)
+            return scale_avx2(dst, src, factor, size);
+#endif
+        scale_scalar(dst, src, factor, size);
+    }
+}
+
+namespace splittercell {
+    namespace kernels {
+        isa detected_isa() {
+            return detected;
+        }
+
+        isa active_isa() {
+            return active;
+        }
+
+        void set_isa(isa level) {
+            active = (level > detected) ? detected : level;
+        }
+
+        const char *isa_name(isa level) {
+            switch(level) {
+                case isa::avx2: return "avx2";
+                case isa::sse2: return "sse2";
+                default:        return "scalar";
+            }
+        }
+
+        bool has_bmi2() {
+            return bmi2;
+        }
+
+        void refine(double *distribution, std::size_t size, unsigned int index, bool positive, double coefficient) {
+            refine_any(distribution, size, index, positive, coefficient);
+        }
+
+        void refine_pairs(double *lo, double *hi, std::size_t size, bool positive, double coefficient) {
+            refine_pairs_any(lo, hi, size, positive, coefficient);
+        }
+
+        void marginals(const double *distribution, unsigned int bits, double *out, std::size_t begin, std::size_t end) {
+            marginals_any(distribution, bits, out, begin, end);
+        }
+
+        double sum(const double *src, std::size_t size) {
+            return sum_any(src, size);
+        }
+
+        void accumulate(double *dst, const double *src, std::size_t size) {
+            accumulate_any(dst, src, size);
+        }
+
+        void scale(double *dst, const double *src, double factor, std::size_t size) {
+            scale_any(dst, src, factor, size);
+        }
+
+        void refine(float *distribution, std::size_t size, unsigned int index, bool positive, double coefficient) {
+            refine_any(distribution, size, index, positive, coefficient);
+        }
+
+        void refine_pairs(float *lo, float *hi, std::size_t size, bool positive, double coefficient) {
+            refine_pairs_any(lo, hi, size, positive, coefficient);
+        }
+
+        void marginals(const float *distribution, unsigned int bits, float *out, std::size_t begin, std::size_t end) {
+            marginals_any(distribution, bits, out, begin, end);
+        }
+
+        float sum(const float *src, std::size_t size) {
+            return sum_any(src, size);
+        }
+
+        void accumulate(float *dst, const float *src, std::size_t size) {
+            accumulate_any(dst, src, size);
+        }
+
+        void scale(float *dst, const float *src, float factor, std::size_t size) {
+            scale_any(dst, src, factor, size);
+        }
+    }
+}
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include "distribution.h"
+
+namespace {
+    const std::size_t chunk_samples = 4096, chunks_per_round = 16;
+
+    /* Possible models of a flock and their running probability sum: the conditioned arguments for one configuration
+     * of the conditioning are drawn by a binary search in its block, which is contiguous (conditioning bits are high) */
+    struct flock_sampler {
+        std::vector<std::size_t> models;
+        std::vector<double> cumulative;
+        std::vector<unsigned int> conditioned, conditioning; //Slots, in the order of the flock indexes
+
+        std::size_t draw(std::size_t configuration, std::mt19937_64 &rng) const {
+            std::size_t bits = conditioned.size(), mask = (std::size_t(1) << bits) - 1;
+            std::size_t first = std::lower_bound(models.cbegin(), models.cend(), configuration << bits) - models.cbegin();
+            std::size_t last  = std::lower_bound(models.cbegin() + first, models.cend(), (configuration + 1) << bits) - models.cbegin();
+            if(first == last) //The flock gives no mass to this configuration, nothing favours any model
+                return std::uniform_int_distribution<std::size_t>(0, mask)(rng);
+            double low = first ? cumulative[first - 1] : 0.0;
+            double u = low + std::uniform_real_distribution<double>()(rng) * (cumulative[last - 1] - low);
+            std::size_t k = std::upper_bound(cumulative.cbegin() + first, cumulative.cbegin() + last, u) - cumulative.cbegin();
+            return models[std::min(k, last - 1)] & mask;
+        }
+    };
+
+    /* Wilson score interval of k successes out of n, unlike the normal one it stays inside [0, 1] near certainty */
+    std::pair<double, double> wilson(std::size_t k, std::size_t n, double z) {
+        double p = double(k) / n, z2 = z * z / n, centre = (p + z2 / 2) / (1 + z2);
+        double half = z * std::sqrt(p * (1 - p) / n + z2 / (4 * n)) / (1 + z2);
+        return {centre - half, centre + half};
+    }
+}
+
+namespace splittercell {
+    template<typename S>
+    approximate_beliefs basic_distribution<S>::approximate(const std::vector<unsigned int> &arguments, const sampling_budget &budget) const {
+        if(budget.max_error <= 0 && budget.seconds <= 0 && budget.max_samples == 0)
+            throw std::invalid_argument("The sampling budget needs a limit.");
+        auto start = std::chrono::steady_clock::now();
+
+        /* Flocks the arguments depend on, each one after the flocks of its conditioning */
+        std::vector<flock_sampler> samplers;
+        std::vector<unsigned int> queried, free; //Arguments outside every flock are drawn from their belief
+        std::vector<bool> flock_seen(_flocks.size(), false), slot_seen(_arguments.size(), false);
+        std::function<void(unsigned int)> visit = [&](unsigned int slot) {
+            auto f = _flock_of[slot];
+            if(f == argument_map::npos) {
+                if(!slot_seen[slot])
+                    free.push_back(slot);
+                slot_seen[slot] = true;
+                return;
+            }
+            if(flock_seen[f])
+                return;
+            flock_seen[f] = true;
+            flock_sampler sampler;
+            for(auto arg : _flocks[f]->conditioning()) {
+                sampler.conditioning.push_back(_slots.at(arg));
+                visit(sampler.conditioning.back());
+            }
+            for(auto arg : _flocks[f]->conditioned())
+                sampler.conditioned.push_back(_slots.at(arg));
+            _flocks[f]->possible_models(sampler.models, sampler.cumulative);
+            std::partial_sum(sampler.cumulative.cbegin(), sampler.cumulative.cend(), sampler.cumulative.begin());
+            samplers.push_back(std::move(sampler));
+        };
+        for(auto arg : arguments) {
+            queried.push_back(_slots.at(arg));
+            visit(queried.back());
+        }
+
+        auto pool = thread_pool::shared();
+        executor *exec = _executor ? _executor.get() : pool.get();
+        std::vector<std::size_t> counts(queried.size(), 0);
+        std::size_t samples = 0, chunks = 0;
+        std::mutex merge;
+        approximate_beliefs result;
+        while(true) {
+            std::size_t round = chunk_samples * chunks_per_round;
+            if(budget.max_samples)
+                round = std::min(round, budget.max_samples - samples);
+            std::size_t round_chunks = (round + chunk_samples - 1) / chunk_samples;
+            exec->parallel_for(round_chunks, 1, [&](std::size_t begin, std::size_t end) {
+                std::vector<std::size_t> partial(queried.size(), 0);
+                std::vector<char> value(_arguments.size(), 0);
+                for(std::size_t c = begin; c < end; c++) {
+                    /* One stream per chunk, numbered across rounds, so the split between threads does not matter */
+                    std::uint64_t id = chunks + c;
+                    std::seed_seq seed({std::uint32_t(budget.seed), std::uint32_t(budget.seed >> 32), std::uint32_t(id), std::uint32_t(id >> 32)});
+                    std::mt19937_64 rng(seed);
+                    for(std::size_t s = c * chunk_samples; s < std::min(round, (c + 1) * chunk_samples); s++) {
+                        for(auto slot : free)
+                            value[slot] = std::bernoulli_distribution(_belief_cache[slot])(rng);
+                        for(auto &sampler : samplers) {
+                            std::size_t configuration = 0;
+                            for(unsigned int j = 0; j < sampler.conditioning.size(); j++)
+                                configuration |= std::size_t(value[sampler.conditioning[j]]) << j;
+                            std::size_t drawn = sampler.draw(configuration, rng);
+                            for(unsigned int j = 0; j < sampler.conditioned.size(); j++)
+                                value[sampler.conditioned[j]] = (drawn >> j) & 1U;
+                        }
+                        for(std::size_t q = 0; q < queried.size(); q++)
+                            partial[q] += value[queried[q]];
+                    }
+                }
+                std::lock_guard<std::mutex> lock(merge);
+                for(std::size_t q = 0; q < queried.size(); q++)
+                    counts[q] += partial[q];
+            });
+            chunks  += round_chunks;
+            samples += round;
+
+            result.max_error = 0;
+            for(std::size_t q = 0; q < queried.size(); q++) {
+                auto interval = wilson(counts[q], samples, budget.z);
+                result.max_error = std::max(result.max_error, (interval.second - interval.first) / 2);
+            }
+            result.converged = budget.max_error > 0 && result.max_error <= budget.max_error;
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if(result.converged || (budget.max_samples && samples >= budget.max_samples) || (budget.seconds > 0 && elapsed >= budget.seconds))
+                break;
+        }
+
+        result.samples = samples;
+        for(std::size_t q = 0; q < queried.size(); q++) {
+            result.beliefs[_arguments[queried[q]]]   = double(counts[q]) / samples;
+            result.intervals[_arguments[queried[q]]] = wilson(counts[q], samples, budget.z);
+        }
+        return result;
+    }
+
+    template approximate_beliefs basic_distribution<double>::approximate(const std::vector<unsigned int> &, const sampling_budget &) const;
+    template approximate_beliefs basic_distribution<float>::approximate(const std::vector<unsigned int> &, const sampling_budget &) const;
+    template approximate_beliefs basic_distribution<log_space<double>>::approximate(const std::vector<unsigned int> &, const sampling_budget &) const;
+}
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include "distribution.h"
+#include "serialization.h"
+
+namespace {
+    using namespace splittercell::serialization;
+
+    /* Writes and counts, the stream does not need to be seekable */
+    class writer {
+    public:
+        explicit writer(std::ostream &out) : _out(out), _position(0) {}
+        void write(const void *data, std::size_t bytes) {
+            _out.write(static_cast<const char*>(data), bytes);
+            _position += bytes;
+        }
+        void pad_to(std::size_t position) {
+            static const char zeros[alignment] = {};
+            while(_position < position)
+                write(zeros, std::min(alignment, position - _position));
+        }
+        void check() const {
+            if(!_out)
+                throw std::runtime_error("Cannot write the distribution.");
+        }
+
+    private:
+        std::ostream &_out;
+        std::size_t _position;
+    };
+
+    /* Bounds checked walk through a mapped file */
+    class reader {
+    public:
+        reader(const char *data, std::size_t length) : _data(data), _length(length), _position(0) {}
+        template<typename T>
+        T read() {
+            T value;
+            std::memcpy(&value, at(_position, sizeof(T)), sizeof(T));
+            _position += sizeof(T);
+            return value;
+        }
+        const char *at(std::size_t offset, std::size_t bytes) const {
+            if(offset > _length || bytes > _length - offset)
+                throw std::runtime_error("Truncated distribution file.");
+            return _data + offset;
+        }
+
+    private:
+        const char *_data;
+        std::size_t _length, _position;
+    };
+
+    const std::size_t chunk_models = 4096;
+
+    /* Whether the argument is one of the conditioned arguments of the flock */
+    template<typename F>
+    bool holds(const F &f, unsigned int argument) {
+        return std::find(f.conditioned().cbegin(), f.conditioned().cend(), argument) != f.conditioned().cend();
+    }
+}
+
+namespace splittercell {
+    template<typename S>
+    void basic_distribution<S>::save(std::ostream &out) const {
+        file_header header;
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version   = version;
+        header.scalar    = scalar_code<S>::value;
+        header.flocks    = _flocks.size();
+        header.arguments = _arguments.size();
+
+        /* Tables go after everything else, their offsets are known before writing anything */
+        std::size_t offset = sizeof(file_header) + _arguments.size() * sizeof(argument_record);
+        for(auto &f : _flocks)
+            offset += sizeof(flock_header) + (f->conditioned().size() + f->conditioning().size()) * sizeof(std::uint32_t);
+        std::vector<std::size_t> offsets;
+        for(auto &f : _flocks) {
+            offset = aligned(offset);
+            offsets.push_back(offset);
+            offset += (std::size_t(1) << f->size()) * sizeof(value_type);
+        }
+
+        writer w(out);
+        w.write(&header, sizeof(header));
+        for(unsigned int f = 0; f < _flocks.size(); f++) {
+            auto &fl = *_flocks[f];
+            flock_header fh = {std::uint32_t(fl.conditioned().size()), std::uint32_t(fl.conditioning().size()), fl.uniform(), 0,
+                               offsets[f], std::uint64_t(1) << fl.size()};
+            w.write(&fh, sizeof(fh));
+            for(auto args : {&fl.conditioned(), &fl.conditioning()})
+                for(std::uint32_t arg : *args)
+                    w.write(&arg, sizeof(arg));
+        }
+        for(unsigned int slot = 0; slot < _arguments.size(); slot++) {
+            argument_record r = {_arguments[slot], (_flock_of[slot] == argument_map::npos) ? no_flock : _flock_of[slot],
+                                 _cache_is_valid[slot], 0, _belief_cache[slot]};
+            w.write(&r, sizeof(r));
+        }
+        for(unsigned int f = 0; f < _flocks.size(); f++) {
+            w.pad_to(offsets[f]);
+            auto &fl = *_flocks[f];
+            if(!fl.sparse()) {
+                w.write(fl.distribution().data(), fl.distribution().size() * sizeof(value_type));
+                continue;
+            }
+            /* A chunk at a time, a sparse flock does not build its full table for it */
+            std::vector<value_type> chunk;
+            chunk.reserve(chunk_models);
+            fl.for_each_model([&](std::size_t, value_type v) {
+                chunk.push_back(v);
+                if(chunk.size() == chunk_models) {
+                    w.write(chunk.data(), chunk.size() * sizeof(value_type));
+                    chunk.clear();
+                }
+            });
+            w.write(chunk.data(), chunk.size() * sizeof(value_type));
+        }
+        w.check();
+    }
+
+    template<typename S>
+    void basic_distribution<S>::save(const std::string &path) const {
+        /* Never in place: the tables may be mapped from path itself */
+        storage::replace_file(path, [this](std::ostream &out) {save(out);});
+    }
+
+    template<typename S>
+    basic_distribution<S> basic_distribution<S>::load(const std::string &path, std::shared_ptr<executor> exec) {
+        std::size_t length;
+        auto mapping = storage::map_file(path, length);
+        reader r(mapping.get(), length);
+
+        auto header = r.read<file_header>();
+        if(std::memcmp(header.magic, magic, sizeof(magic)) != 0)
+            throw std::runtime_error(path + " is not a distribution.");
+        if(header.version != version)
+            throw std::runtime_error(path + " has format version " + std::to_string(header.version) + ".");
+        if(header.scalar != scalar_code<S>::value)
+            throw std::runtime_error(path + " holds tables of another scalar type.");
+
+        basic_distribution d(std::vector<unsigned int>(), {}, std::move(exec));
+        for(std::uint64_t f = 0; f < header.flocks; f++) {
+            auto fh = r.read<flock_header>();
+            /* Before anything is read or multiplied from the header */
+            std::uint64_t size = std::uint64_t(fh.conditioned) + fh.conditioning;
+            if(size > max_flock_arguments || fh.models != (std::uint64_t(1) << size) ||
+               fh.models > std::numeric_limits<std::size_t>::max() / sizeof(value_type) || fh.offset % alignment != 0)
+                throw std::runtime_error("Corrupted flock in " + path + ".");
+            std::vector<unsigned int> conditioned, conditioning;
+            for(std::uint32_t a = 0; a < fh.conditioned; a++)
+                conditioned.push_back(r.read<std::uint32_t>());
+            for(std::uint32_t a = 0; a < fh.conditioning; a++)
+                conditioning.push_back(r.read<std::uint32_t>());
+
+            /* In place: the table keeps the mapping alive */
+            auto data = reinterpret_cast<value_type*>(const_cast<char*>(r.at(fh.offset, fh.models * sizeof(value_type))));
+            d._flocks.push_back(std::make_shared<flock_type>(conditioned, conditioning, table<value_type>(data, fh.models, mapping), fh.uniform != 0));
+            d._versions.push_back(next_version());
+            d._published_flocks.push_back(false);
+        }
+        for(std::uint64_t a = 0; a < header.arguments; a++) {
+            auto record = r.read<argument_record>();
+            if(d._slots.contains(record.argument) ||
+               (record.flock != no_flock && (record.flock >= d._flocks.size() || !holds(*d._flocks[record.flock], record.argument))))
+                throw std::runtime_error("Corrupted argument in " + path + ".");
+            d.add_argument(record.argument, (record.flock == no_flock) ? argument_map::npos : record.flock, record.valid != 0, record.belief);
+        }
+        /* Every conditioned argument is claimed by its own flock, so none is in two of them, and every conditioning one
+         * by some flock, which queries walk up to */
+        for(unsigned int f = 0; f < d._flocks.size(); f++) {
+            for(auto arg : d._flocks[f]->conditioned())
+                if(!d._slots.contains(arg) || d._flock_of[d._slots.at(arg)] != f)
+                    throw std::runtime_error("Corrupted argument in " + path + ".");
+            for(auto arg : d._flocks[f]->conditioning())
+                if(!d._slots.contains(arg) || d._flock_of[d._slots.at(arg)] == argument_map::npos)
+                    throw std::runtime_error("Corrupted argument in " + path + ".");
+        }
+        d.link_flocks();
+        return d;
+    }
+
+    template void basic_distribution<double>::save(std::ostream &) const;
+    template void basic_distribution<double>::save(const std::string &) const;
+    template basic_distribution<double> basic_distribution<double>::load(const std::string &, std::shared_ptr<executor>);
+    template void basic_distribution<float>::save(std::ostream &) const;
+    template void basic_distribution<float>::save(const std::string &) const;
+    template basic_distribution<float> basic_distribution<float>::load(const std::string &, std::shared_ptr<executor>);
+    template void basic_distribution<log_space<double>>::save(std::ostream &) const;
+    template void basic_distribution<log_space<double>>::save(const std::string &) const;
+    template basic_distribution<log_space<double>> basic_distribution<log_space<double>>::load(const std::string &, std::shared_ptr<executor>);
+}
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <memory>
+#include "stats.h"
+
+#ifndef SPLITTERCELL_STATS
+#define SPLITTERCELL_STATS 0
+#endif
+
+namespace {
+    using namespace splittercell::stats;
+
+    std::array<std::atomic<std::uint64_t>, counter_count> counters;
+    std::array<std::atomic<std::uint64_t>, kernel_count> kernel_calls, kernel_nanoseconds;
+    std::shared_ptr<const std::function<void(const query_report &)>> query_callback;
+
+    std::uint64_t get(counter c) {
+        return counters[static_cast<unsigned int>(c)];
+    }
+}
+
+namespace splittercell {
+    namespace stats {
+        const bool enabled = SPLITTERCELL_STATS;
+
+        bool compiled_in() {
+            return enabled;
+        }
+
+        snapshot current() {
+            snapshot s;
+            s.queries              = get(counter::queries);
+            s.belief_hits          = get(counter::belief_hits);
+            s.belief_misses        = get(counter::belief_misses);
+            s.factor_hits          = get(counter::factor_hits);
+            s.factor_misses        = get(counter::factor_misses);
+            s.combines             = get(counter::combines);
+            s.combined_models      = get(counter::combined_models);
+            s.largest_combined     = get(counter::largest_combined);
+            s.bytes_allocated      = get(counter::bytes_allocated);
+            s.bytes_live           = get(counter::bytes_live);
+            s.parallel_loops       = get(counter::parallel_loops);
+            s.tasks                = get(counter::tasks);
+            s.steals               = get(counter::steals);
+            s.busy_nanoseconds     = get(counter::busy_nanoseconds);
+            s.capacity_nanoseconds = get(counter::capacity_nanoseconds);
+            for(unsigned int k = 0; k < kernel_count; k++) {
+                s.kernel_calls[k]       = kernel_calls[k];
+                s.kernel_nanoseconds[k] = kernel_nanoseconds[k];
+            }
+            return s;
+        }
+
+        void reset() {
+            for(auto &c : counters)
+                if(&c != &counters[static_cast<unsigned int>(counter::bytes_live)]) //Still allocated after the reset
+                    c = 0;
+            for(unsigned int k = 0; k < kernel_count; k++) {
+                kernel_calls[k]       = 0;
+                kernel_nanoseconds[k] = 0;
+            }
+        }
+
+        void set_query_callback(std::function<void(const query_report &)> callback) {
+            std::shared_ptr<const std::function<void(const query_report &)>> c;
+            if(callback)
+                c = std::make_shared<const std::function<void(const query_report &)>>(std::move(callback));
+            std::atomic_store(&query_callback, c);
+        }
+
+        void add_counter(counter c, std::uint64_t n) {
+            counters[static_cast<unsigned int>(c)] += n;
+        }
+
+        void max_counter(counter c, std::uint64_t n) {
+            auto &m = counters[static_cast<unsigned int>(c)];
+            auto seen = m.load();
+            while(seen < n && !m.compare_exchange_weak(seen, n));
+        }
+
+        void add_kernel(kernel k, std::uint64_t nanoseconds) {
+            kernel_calls[static_cast<unsigned int>(k)]++;
+            kernel_nanoseconds[static_cast<unsigned int>(k)] += nanoseconds;
+        }
+
+        void report(const query_report &r) {
+            auto callback = std::atomic_load(&query_callback);
+            if(callback)
+                (*callback)(r);
+        }
+    }
+}
@@ -0,0 +1,311 @@
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+#include <fstream>
+#include <cstdio>
+#include "table_storage.h"
+#include "stats.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SPLITTERCELL_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+    /* Every block starts with where it comes from, so a change of policy never mismatches a deallocation */
+    enum class origin : std::size_t {heap, anonymous, file};
+    struct header {
+        origin from;
+        std::size_t length; //Of the whole mapping
+        void *workspace;    //The pool it goes back to, if any
+        void *heap;         //What malloc returned, the block is aligned inside it
+    };
+    const std::size_t header_bytes = 64;
+
+    std::mutex policy_mutex;
+    splittercell::storage::policy active = {splittercell::storage::default_mapped_threshold, std::string()};
+    std::atomic<std::size_t> threshold(splittercell::storage::default_mapped_threshold); //Of active, read without the lock
+    std::atomic<std::size_t> mapped(0);
+    thread_local void *bound = nullptr; //Pool of the workspace bound to the thread
+
+#ifdef SPLITTERCELL_MMAP
+    int flags() {
+        int f = MAP_SHARED;
+#ifdef MAP_NORESERVE
+        f |= MAP_NORESERVE; //Pages are only committed once written
+#endif
+        return f;
+    }
+
+    void *map_backing_file(const std::string &directory, std::size_t length) {
+        std::string name = directory + "/splittercell-XXXXXX";
+        int fd = mkstemp(&name[0]);
+        if(fd < 0)
+            return MAP_FAILED;
+        unlink(name.c_str()); //Released with the mapping
+        void *p = (ftruncate(fd, length) == 0) ? mmap(nullptr, length, PROT_READ | PROT_WRITE, flags(), fd, 0) : MAP_FAILED;
+        close(fd);
+        return p;
+    }
+
+    void *map_anonymous(std::size_t length) {
+#ifdef MAP_ANONYMOUS
+        return mmap(nullptr, length, PROT_READ | PROT_WRITE, (flags() & ~MAP_SHARED) | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+        return mmap(nullptr, length, PROT_READ | PROT_WRITE, (flags() & ~MAP_SHARED) | MAP_PRIVATE | MAP_ANON, -1, 0);
+#endif
+    }
+#endif
+
+    void release(void *block) {
+        header h = *static_cast<header*>(block);
+        if(h.from == origin::heap)
+            return std::free(h.heap);
+#ifdef SPLITTERCELL_MMAP
+        munmap(block, h.length);
+        mapped -= h.length;
+#endif
+    }
+}
+
+namespace splittercell {
+    namespace storage {
+        policy current_policy() {
+            std::lock_guard<std::mutex> lock(policy_mutex);
+            return active;
+        }
+
+        void set_policy(const policy &p) {
+            std::lock_guard<std::mutex> lock(policy_mutex);
+            active    = p;
+            threshold = p.mapped_threshold;
+        }
+
+        std::size_t mapped_bytes() {
+            return mapped;
+        }
+
+        /* Blocks kept aside hold no reference, the pool goes away with the workspace and the last block in use */
+        struct workspace::pool {
+            std::size_t limit, kept, fresh, reused;
+            bool open;
+            std::atomic<std::size_t> references;
+            std::mutex mutex;
+            std::unordered_map<std::size_t, std::vector<void*>> blocks; //Per size asked for
+
+            explicit pool(std::size_t l) : limit(l), kept(0), fresh(0), reused(0), open(true), references(1) {}
+
+            void *take(std::size_t bytes) {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = blocks.find(bytes);
+                if(it == blocks.end() || it->second.empty())
+                    return nullptr;
+                void *block = it->second.back();
+                it->second.pop_back();
+                kept -= static_cast<header*>(block)->length;
+                reused++;
+                references++;
+                return block;
+            }
+
+            void adopt(void *block) {
+                std::lock_guard<std::mutex> lock(mutex);
+                static_cast<header*>(block)->workspace = this;
+                fresh++;
+                references++;
+            }
+
+            void give_back(void *block, std::size_t bytes) {
+                std::size_t length = static_cast<header*>(block)->length;
+                bool keep;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    keep = open && kept + length <= limit;
+                    if(keep) {
+                        blocks[bytes].push_back(block);
+                        kept += length;
+                    }
+                }
+                if(!keep)
+                    release(block);
+                unreference();
+            }
+
+            void clear(bool close) {
+                std::unordered_map<std::size_t, std::vector<void*>> dropped;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    open = open && !close;
+                    kept = 0;
+                    for(auto &b : blocks) //The lists keep their capacity
+                        dropped[b.first].swap(b.second);
+                }
+                for(auto &b : dropped)
+                    for(auto block : b.second)
+                        release(block);
+            }
+
+            void unreference() {
+                if(--references == 0)
+                    delete this;
+            }
+        };
+
+        workspace::workspace(std::size_t limit) : _pool(new pool(limit)) {}
+
+        workspace::~workspace() {
+            _pool->clear(true);
+            _pool->unreference();
+        }
+
+        std::size_t workspace::fresh() const {
+            std::lock_guard<std::mutex> lock(_pool->mutex);
+            return _pool->fresh;
+        }
+
+        std::size_t workspace::reused() const {
+            std::lock_guard<std::mutex> lock(_pool->mutex);
+            return _pool->reused;
+        }
+
+        std::size_t workspace::kept_bytes() const {
+            std::lock_guard<std::mutex> lock(_pool->mutex);
+            return _pool->kept;
+        }
+
+        void workspace::trim() {
+            _pool->clear(false);
+        }
+
+        workspace::scope::scope(workspace *w) : _previous(bound) {
+            bound = w ? w->_pool : nullptr;
+        }
+
+        workspace::scope::~scope() {
+            bound = _previous;
+        }
+
+        void *allocate(std::size_t bytes) {
+            auto w = static_cast<workspace::pool*>(bound);
+            void *reused = w ? w->take(bytes) : nullptr;
+            if(reused != nullptr) {
+                stats::count(stats::counter::bytes_live, bytes);
+                return static_cast<char*>(reused) + header_bytes;
+            }
+
+            std::size_t length = bytes + header_bytes;
+            header h = {origin::heap, length, nullptr, nullptr};
+            void *block = nullptr;
+#ifdef SPLITTERCELL_MMAP
+            policy p;
+            if(length >= threshold && length >= (p = current_policy()).mapped_threshold) {
+                h.from = p.directory.empty() ? origin::anonymous : origin::file;
+                block  = (h.from == origin::file) ? map_backing_file(p.directory, length) : map_anonymous(length);
+                if(block == MAP_FAILED)
+                    throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+                madvise(block, length, MADV_HUGEPAGE);
+#endif
+                mapped += length;
+            }
+#endif
+            /* Aligned by hand, posix_memalign is several times slower than malloc for the small tables */
+            if(h.from == origin::heap) {
+                h.heap = std::malloc(length + header_bytes);
+                if(h.heap == nullptr)
+                    throw std::bad_alloc();
+                block = reinterpret_cast<void*>((reinterpret_cast<std::uintptr_t>(h.heap) + header_bytes - 1) / header_bytes * header_bytes);
+            }
+            *static_cast<header*>(block) = h;
+            if(w)
+                w->adopt(block);
+            stats::count(stats::counter::bytes_allocated, bytes);
+            stats::count(stats::counter::bytes_live, bytes);
+            return static_cast<char*>(block) + header_bytes;
+        }
+
+        void deallocate(void *p, std::size_t bytes) {
+            if(p == nullptr)
+                return;
+            stats::count(stats::counter::bytes_live, -std::uint64_t(bytes)); //Wraps back
+            void *block = static_cast<char*>(p) - header_bytes;
+            auto w = static_cast<workspace::pool*>(static_cast<header*>(block)->workspace);
+            if(w)
+                w->give_back(block, bytes);
+            else
+                release(block);
+        }
+
+        std::shared_ptr<char> map_file(const std::string &path, std::size_t &length) {
+#ifdef SPLITTERCELL_MMAP
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if(fd < 0 || fstat(fd, &st) != 0) {
+                if(fd >= 0)
+                    close(fd);
+                throw std::runtime_error("Cannot open " + path + ".");
+            }
+            length  = st.st_size;
+            void *p = (length == 0) ? MAP_FAILED : mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if(p == MAP_FAILED)
+                throw std::runtime_error("Cannot map " + path + ".");
+            std::size_t mapping = length;
+            return std::shared_ptr<char>(static_cast<char*>(p), [mapping](char *m) {munmap(m, mapping);});
+#else
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            if(!in)
+                throw std::runtime_error("Cannot open " + path + ".");
+            length = in.tellg();
+            auto block = std::shared_ptr<char>(static_cast<char*>(allocate(length)), [length](char *m) {deallocate(m, length);});
+            in.seekg(0);
+            in.read(block.get(), length);
+            return block;
+#endif
+        }
+
+        void replace_file(const std::string &path, const std::function<void(std::ostream &)> &write) {
+#ifdef SPLITTERCELL_MMAP
+            std::string temporary = path + ".XXXXXX";
+            int fd = mkstemp(&temporary[0]);
+            if(fd < 0)
+                throw std::runtime_error("Cannot create a file next to " + path + ".");
+            struct stat st;
+            fchmod(fd, (stat(path.c_str(), &st) == 0) ? (st.st_mode & 07777) : 0644); //mkstemp makes it private
+            close(fd);
+#else
+            std::string temporary = path + ".tmp";
+#endif
+            try {
+                std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+                if(!out)
+                    throw std::runtime_error("Cannot open " + temporary + ".");
+                write(out);
+                out.close();
+                if(!out)
+                    throw std::runtime_error("Cannot write " + temporary + ".");
+#ifdef SPLITTERCELL_MMAP
+                fd = open(temporary.c_str(), O_WRONLY);
+                bool synced = fd >= 0 && fsync(fd) == 0;
+                if(fd >= 0)
+                    close(fd);
+                if(!synced)
+                    throw std::runtime_error("Cannot sync " + temporary + ".");
+#endif
+                if(std::rename(temporary.c_str(), path.c_str()) != 0)
+                    throw std::runtime_error("Cannot replace " + path + ".");
+            } catch(...) {
+                std::remove(temporary.c_str());
+                throw;
+            }
+        }
+    }
+}
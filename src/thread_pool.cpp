@@ -0,0 +1,150 @@
+#include <exception>
+#include <algorithm>
+#include "thread_pool.h"
+#include "stats.h"
+
+namespace {
+    thread_local const splittercell::thread_pool *current_pool = nullptr;
+
+    std::mutex shared_mutex;
+    std::shared_ptr<splittercell::thread_pool> shared_pool;
+}
+
+namespace splittercell {
+    struct thread_pool::job {
+        const std::function<void(std::size_t, std::size_t)> *body;
+        std::atomic<std::size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+    thread_pool::thread_pool(unsigned int threads) : _pending(0), _stop(false) {
+        if(threads == 0)
+            threads = 1;
+        for(unsigned int i = 0; i < threads; i++)
+            _queues.push_back(std::make_unique<queue>());
+        for(unsigned int i = 1; i < threads; i++)
+            _workers.emplace_back(&thread_pool::work, this, i);
+    }
+
+    thread_pool::~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(_sleep_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(auto &w : _workers)
+            w.join();
+    }
+
+    void thread_pool::parallel_for(std::size_t bound, std::size_t grain, const std::function<void(std::size_t, std::size_t)> &body) {
+        if(bound == 0)
+            return;
+        if(grain == 0)
+            grain = 1;
+        std::size_t chunks = (bound + grain - 1) / grain, wanted = 4 * _queues.size();
+        if(chunks > wanted) //Chunks stay multiples of grain, the last one takes the tail
+            grain *= chunks / wanted;
+        chunks = (bound + grain - 1) / grain;
+        if(chunks == 1 || _queues.size() == 1 || current_pool == this) { //Nested loops run inline
+            body(0, bound);
+            return;
+        }
+
+        std::uint64_t start = stats::enabled ? stats::now() : 0;
+        job j;
+        j.body = &body;
+        j.remaining = chunks;
+        {
+            std::lock_guard<std::mutex> lock(_sleep_mutex);
+            _pending += chunks; //Before the push so that a thief never sees more tasks than pending
+        }
+        std::size_t per_queue = (chunks + _queues.size() - 1) / _queues.size();
+        for(std::size_t c = 0; c < chunks; c++) {
+            auto &q = *_queues[c / per_queue];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back({&j, c * grain, std::min(bound, (c + 1) * grain)});
+        }
+        _wake.notify_all();
+
+        while(j.remaining > 0 && run_one(0));
+        std::unique_lock<std::mutex> lock(j.mutex);
+        j.done.wait(lock, [&j]{return j.remaining == 0;});
+        stats::count(stats::counter::parallel_loops);
+        stats::count(stats::counter::capacity_nanoseconds, stats::enabled ? (stats::now() - start) * _queues.size() : 0);
+        if(j.error)
+            std::rethrow_exception(j.error);
+    }
+
+    bool thread_pool::run_one(unsigned int self) {
+        task t = {nullptr, 0, 0};
+        bool stolen = false;
+        for(unsigned int k = 0; k < _queues.size() && t.owner == nullptr; k++) {
+            auto &q = *_queues[(self + k) % _queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if(q.tasks.empty())
+                continue;
+            if(k == 0) { //Own work from the front, stolen work from the back
+                t = q.tasks.front();
+                q.tasks.pop_front();
+            } else {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+                stolen = true;
+            }
+        }
+        if(t.owner == nullptr)
+            return false;
+        _pending--;
+
+        stats::count(stats::counter::tasks);
+        stats::count(stats::counter::steals, stolen);
+        std::uint64_t start = stats::enabled ? stats::now() : 0;
+        auto previous = current_pool;
+        current_pool = this;
+        try {
+            (*t.owner->body)(t.begin, t.end);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(t.owner->mutex);
+            if(!t.owner->error)
+                t.owner->error = std::current_exception();
+        }
+        current_pool = previous;
+        stats::count(stats::counter::busy_nanoseconds, stats::enabled ? stats::now() - start : 0);
+
+        std::lock_guard<std::mutex> lock(t.owner->mutex);
+        if(--t.owner->remaining == 0)
+            t.owner->done.notify_all();
+        return true;
+    }
+
+    void thread_pool::work(unsigned int self) {
+        current_pool = this;
+        while(true) {
+            if(run_one(self))
+                continue;
+            std::unique_lock<std::mutex> lock(_sleep_mutex);
+            _wake.wait(lock, [this]{return _stop || _pending > 0;});
+            if(_stop)
+                return;
+        }
+    }
+
+    std::shared_ptr<thread_pool> thread_pool::shared() {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        if(!shared_pool)
+            shared_pool = std::make_shared<thread_pool>();
+        return shared_pool;
+    }
+
+    void thread_pool::set_shared_threads(unsigned int threads) {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        shared_pool = std::make_shared<thread_pool>(threads);
+    }
+
+    sequential_executor &no_parallelism() {
+        static sequential_executor sequential;
+        return sequential;
+    }
+}
@@ -1,10 +1,23 @@
 #include <memory>
+#include <atomic>
+#include <cmath>
+#include <sstream>
+#include <fstream>
+#include <cstddef>
+#include <thread>
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 #include "distribution.h"
+#include "kernels.h"
+#include "small_kernels.h"
+#include "elimination.h"
+#include "distribution_batch.h"
+#include "serialization.h"
+#include "stats.h"
 
 using ::testing::ElementsAreArray;
 using ::testing::DoubleEq;
+using ::testing::DoubleNear;
 using ::testing::StrEq;
 
 class DistributionTest: public ::testing::Test {
@@ -223,3 +236,1043 @@ TEST(StressTestMT, HugeCombination) {
     auto f2 = std::make_unique<splittercell::flock>(args2);
     f1.combine(f2.get());
 }
+
+TEST(KernelTest, RefineSameOnEveryIsa) {
+    std::vector<double> reference(1U << 10);
+    for(unsigned int i = 0; i < reference.size(); i++)
+        reference[i] = (i % 7) / 3000.0;
+    for(unsigned int index = 0; index < 10; index++) {
+        splittercell::kernels::set_isa(splittercell::kernels::isa::scalar);
+        auto expected = reference;
+        splittercell::kernels::refine(expected.data(), expected.size(), index, index % 2, 0.3);
+        for(auto level : {splittercell::kernels::isa::sse2, splittercell::kernels::isa::avx2}) {
+            splittercell::kernels::set_isa(level);
+            auto actual = reference;
+            splittercell::kernels::refine(actual.data(), actual.size(), index, index % 2, 0.3);
+            EXPECT_THAT(actual, ElementsAreArray(expected));
+        }
+    }
+    splittercell::kernels::set_isa(splittercell::kernels::detected_isa());
+}
+
+TEST_F(DistributionTest, AllMarginals) {
+    auto m = conditioned->get_flock(0)->all_marginals();
+    EXPECT_THAT(m, ElementsAreArray({DoubleEq(0.3), DoubleEq(0.4), DoubleEq(0.7)}));
+
+    std::vector<unsigned int> args;
+    for(unsigned int i = 0; i < 14; i++)
+        args.push_back(i);
+    std::vector<double> probabilities(1U << 14);
+    for(unsigned int i = 0; i < probabilities.size(); i++)
+        probabilities[i] = (i % 5) + 1;
+    splittercell::flock f(args, {}, probabilities);
+    auto all = f.all_marginals();
+    for(unsigned int arg = 0; arg < 14; arg++)
+        EXPECT_THAT(all[arg], DoubleEq(f.marginalize({arg})->distribution()[1]));
+}
+
+TEST_F(DistributionTest, BeliefsAll) {
+    auto beliefs = threeflocks->beliefs_all();
+    EXPECT_THAT(beliefs.size(), 5);
+    EXPECT_THAT(beliefs[0], DoubleEq(0.49125));
+    EXPECT_THAT(beliefs[2], DoubleEq(0.475));
+    EXPECT_THAT(beliefs[3], DoubleEq(0.55));
+    EXPECT_THAT(beliefs[4], DoubleEq(0.5));
+}
+
+TEST(GatherPlanTest, SameAsBitByBit) {
+    std::vector<double> src(1U << 12);
+    for(unsigned int i = 0; i < src.size(); i++)
+        src[i] = (i % 11) + 0.5;
+    const unsigned int x = splittercell::gather_plan::dropped;
+    std::vector<std::vector<unsigned int>> layouts = {
+        {x, x, 0, 1, x, 2, x, x, 3, x, x, x}, //Low bits dropped
+        {0, 1, 2, x, x, 4, 3, x, x, x, x, x}, //Low bits kept in place
+        {x, 0, x, 1, 2, x, x, x, x, x, x, 3}, //Kept in order
+        {x, 3, x, 0, 2, x, x, 1, x, x, x, 4}, //Shuffled
+        {11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0}};
+    for(auto &layout : layouts) {
+        splittercell::gather_plan plan(layout);
+        std::vector<double> expected(1U << plan.destination_bits(), 0.0), actual(expected.size(), 0.0);
+        for(unsigned int i = 0; i < src.size(); i++) {
+            unsigned int end = 0;
+            for(unsigned int b = 0; b < layout.size(); b++)
+                if(layout[b] != x && (i & (1U << b)))
+                    end |= 1U << layout[b];
+            EXPECT_EQ(plan.map(i), end);
+            expected[end] += src[i];
+        }
+        plan.marginalize(src.data(), actual.data());
+        for(unsigned int i = 0; i < expected.size(); i++)
+            EXPECT_THAT(actual[i], DoubleEq(expected[i]));
+    }
+}
+
+TEST(GatherPlanTest, SixtyFourBitIndexes) {
+    const unsigned int x = splittercell::gather_plan::dropped;
+    std::vector<unsigned int> layout(40, x);
+    layout[2]  = 1;
+    layout[35] = 0;
+    layout[39] = 33;
+    splittercell::gather_plan plan(layout);
+    EXPECT_EQ(plan.map(std::size_t(1) << 35), 1U);
+    EXPECT_EQ(plan.map((std::size_t(1) << 39) | 4), (std::size_t(1) << 33) | 2);
+}
+
+TEST(CombineTest, SameAsBitByBit) {
+    std::vector<double> p1(1U << 6), p2(1U << 2, 0.25);
+    for(unsigned int i = 0; i < p1.size(); i++)
+        p1[i] = (i % 3 + 1) / 96.0;
+    p2[1] = 0.1; p2[3] = 0.4;
+    splittercell::flock f1({0,1,2,3,4}, {5}, p1), f2({5,6}, {}, p2);
+    for(auto pair : {std::make_pair(&f1, &f2), std::make_pair(&f2, &f1)}) {
+        auto combined = pair.first->combine(pair.second, false);
+        ASSERT_EQ(combined->size(), 7);
+        for(unsigned int i = 0; i < combined->distribution().size(); i++) {
+            unsigned int end1 = 0, end2 = 0;
+            for(unsigned int arg = 0; arg < 7; arg++)
+                if(i & (1U << combined->index(arg))) {
+                    if(arg != 6)
+                        end1 |= 1U << f1.index(arg);
+                    if(arg >= 5)
+                        end2 |= 1U << f2.index(arg);
+                }
+            EXPECT_THAT(combined->distribution()[i], DoubleEq(p1[end1] * p2[end2]));
+        }
+    }
+}
+
+TEST(SmallKernelTest, SameAsPlansAndKernels) {
+    typedef splittercell::scalar_traits<double> traits;
+    const unsigned int x = splittercell::gather_plan::dropped;
+    for(unsigned int size = 1; size <= splittercell::small::max_bits; size++)
+        splittercell::small::by_size<>::call(size, [x](auto n) {
+            const unsigned int bits = decltype(n)::value;
+            std::vector<double> t(std::size_t(1) << bits), expected(t.size());
+            for(unsigned int i = 0; i < t.size(); i++)
+                t[i] = (i % 7 + 1) / 10.0;
+            for(unsigned int index = 0; index < bits; index++) {
+                auto actual = t;
+                expected = t;
+                splittercell::small::refine<bits, traits>(actual.data(), index, index % 2, 0.3);
+                traits::refine(expected.data(), expected.size(), index, index % 2, 0.3);
+                EXPECT_THAT(actual, ElementsAreArray(expected));
+            }
+
+            std::vector<double> marginals(bits), reference(bits, 0.0);
+            splittercell::small::marginals<bits, traits>(t.data(), marginals.data());
+            traits::marginals(t.data(), bits, reference.data(), 0, t.size());
+            for(unsigned int b = 0; b < bits; b++)
+                EXPECT_THAT(marginals[b], DoubleNear(reference[b], 1e-12));
+
+            /* Every other bit kept, in reverse order, and the product with a table over the kept bits */
+            std::vector<unsigned int> layout(bits, x), other(bits, x), self(bits);
+            splittercell::small::masks masks{}, to_self{}, to_other{};
+            unsigned int kept = 0;
+            for(unsigned int b = bits; b-- > 0;)
+                if(b % 2 == 0)
+                    layout[b] = kept++;
+            for(unsigned int b = 0; b < bits; b++) {
+                self[b]     = b;
+                other[b]    = layout[b];
+                masks[b]    = (layout[b] == x) ? 0 : 1U << layout[b];
+                to_self[b]  = 1U << b;
+                to_other[b] = masks[b];
+            }
+            std::vector<double> dst(std::size_t(1) << kept, 0.0), gathered(dst.size(), 0.0);
+            splittercell::small::marginalize<bits, traits>(t.data(), dst.data(), masks);
+            splittercell::gather_plan(layout).marginalize(t.data(), gathered.data());
+            EXPECT_THAT(dst, ElementsAreArray(gathered));
+
+            std::vector<double> product(t.size()), planned(t.size());
+            splittercell::small::multiply<bits, traits>(t.data(), dst.data(), product.data(), to_self, to_other);
+            splittercell::product_plan plan(self, other);
+            plan.multiply(t.data(), dst.data(), planned.data(), 0, plan.blocks());
+            EXPECT_THAT(product, ElementsAreArray(planned));
+        });
+}
+
+TEST(ThreadPoolTest, CoversWholeRange) {
+    splittercell::thread_pool pool(4);
+    for(std::size_t bound : {1UL, 7UL, 1000UL, 12345UL}) {
+        std::vector<std::atomic<unsigned int>> seen(bound);
+        for(auto &s : seen)
+            s = 0;
+        pool.parallel_for(bound, 8, [&](std::size_t begin, std::size_t end) {
+            for(std::size_t i = begin; i < end; i++)
+                seen[i]++;
+        });
+        for(auto &s : seen)
+            EXPECT_EQ(s, 1U);
+    }
+    EXPECT_THROW(pool.parallel_for(100, 1, [](std::size_t begin, std::size_t) {
+        if(begin > 40) throw std::runtime_error("chunk");
+    }), std::runtime_error);
+}
+
+TEST(ThreadPoolTest, CappedSharesAPool) {
+    auto pool = std::make_shared<splittercell::thread_pool>(4);
+    splittercell::capped_executor capped(2, pool);
+    EXPECT_EQ(capped.concurrency(), 2U);
+    std::atomic<unsigned int> chunks(0);
+    std::vector<unsigned int> seen(1000, 0);
+    capped.parallel_for(seen.size(), 8, [&](std::size_t begin, std::size_t end) {
+        chunks++;
+        for(std::size_t i = begin; i < end; i++)
+            seen[i]++;
+    });
+    EXPECT_LE(chunks.load(), 2U);
+    for(auto &s : seen)
+        EXPECT_EQ(s, 1U);
+    chunks = 0;
+    capped.parallel_for(seen.size(), 0, [&](std::size_t, std::size_t) {chunks++;}); //A grain of 0 is 1, as in the pool
+    EXPECT_LE(chunks.load(), 2U);
+
+    std::vector<std::unique_ptr<splittercell::flock>> v1, v2;
+    for(auto v : {&v1, &v2}) {
+        v->push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({0, 1})));
+        v->push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({2}), std::vector<unsigned int>({0})));
+    }
+    splittercell::distribution sequential(v1, false), parallel(v2, true);
+    parallel.set_threads(2);
+    for(auto d : {&sequential, &parallel}) {
+        d->refine(0, true, 0.3);
+        d->refine(2, false, 0.6);
+    }
+    EXPECT_EQ(sequential.beliefs_all(), parallel.beliefs_all());
+}
+
+TEST(ThreadPoolTest, SameAsSequential) {
+    auto pool = std::make_shared<splittercell::thread_pool>(4);
+    std::vector<unsigned int> args1, args2;
+    for(unsigned int i = 0; i < 9; i++)
+        args1.push_back(i);
+    for(unsigned int i = 9; i < 17; i++)
+        args2.push_back(i);
+    std::vector<double> p1(1U << 10), p2(1U << 8);
+    for(unsigned int i = 0; i < p1.size(); i++)
+        p1[i] = (i % 13 + 1) / 7000.0;
+    for(unsigned int i = 0; i < p2.size(); i++)
+        p2[i] = (i % 5 + 1) / 800.0;
+    splittercell::flock f1(args1, {9}, p1), f2(args2, {}, p2);
+
+    auto sequential = f1.combine(&f2, false), parallel = f1.combine(&f2, pool.get());
+    EXPECT_THAT(parallel->distribution(), ElementsAreArray(sequential->distribution()));
+    for(unsigned int index : {0U, 4U, 16U}) {
+        sequential->refine(index, true, 0.4, &splittercell::no_parallelism());
+        parallel->refine(index, true, 0.4, pool.get());
+        EXPECT_THAT(parallel->distribution(), ElementsAreArray(sequential->distribution()));
+    }
+    auto m1 = sequential->all_marginals(&splittercell::no_parallelism()), m2 = parallel->all_marginals(pool.get());
+    for(unsigned int b = 0; b < m1.size(); b++)
+        EXPECT_THAT(m2[b], DoubleNear(m1[b], 1e-12)); //Chunks are summed in another order
+    auto r1 = sequential->marginalize({3, 12}, &splittercell::no_parallelism())->distribution();
+    auto r2 = parallel->marginalize({3, 12}, pool.get())->distribution();
+    for(unsigned int i = 0; i < r1.size(); i++)
+        EXPECT_THAT(r2[i], DoubleNear(r1[i], 1e-12));
+}
+
+TEST(RefineBatchTest, SameAsInOrder) {
+    auto pool = std::make_shared<splittercell::thread_pool>(4);
+    std::vector<unsigned int> args;
+    for(unsigned int i = 0; i < 15; i++)
+        args.push_back(i);
+    std::vector<double> p(1U << 16);
+    for(unsigned int i = 0; i < p.size(); i++)
+        p[i] = (i % 11 + 1) / (6.0 * p.size());
+    std::vector<splittercell::update> updates({{3, true, 0.2}, {0, false, 0.5}, {13, true, 0.3}, {3, false, 0.4},
+                                               {11, true, 0.1}, {14, false, 0.6}, {12, true, 0.7}, {3, true, 0.25}});
+
+    splittercell::flock sequential(args, {15}, p), batched(sequential), parallel(sequential);
+    for(auto &u : updates)
+        sequential.refine(u.argument, u.positive, u.coefficient);
+    batched.refine_batch(updates, &splittercell::no_parallelism());
+    parallel.refine_batch(updates, pool.get());
+    EXPECT_THAT(parallel.distribution(), ElementsAreArray(batched.distribution()));
+    for(std::size_t i = 0; i < p.size(); i++)
+        EXPECT_THAT(batched.distribution()[i], DoubleNear(sequential.distribution()[i], 1e-15));
+
+    std::vector<double> logs;
+    for(double v : p)
+        logs.push_back(std::log(v));
+    splittercell::log_flock log_batched(args, {15}, logs);
+    log_batched.refine_batch(updates);
+    for(std::size_t i = 0; i < p.size(); i++)
+        EXPECT_THAT(std::exp(log_batched.distribution()[i]), DoubleNear(sequential.distribution()[i], 1e-15));
+    EXPECT_THROW(batched.refine_batch({{0, true, 0.5}, {15, true, 0.5}}), std::invalid_argument);
+}
+
+TEST_F(DistributionTest, RefineBatch) {
+    splittercell::distribution sequential(*threeflocks);
+    std::vector<splittercell::update> updates({{0, true, 0.5}, {3, false, 0.25}, {1, true, 0.3}, {4, true, 0.1}, {0, false, 0.2}});
+    threeflocks->refine_batch(updates);
+    for(auto &u : updates)
+        sequential.refine(u.argument, u.positive, u.coefficient);
+    auto expected = sequential.beliefs_all(), beliefs = threeflocks->beliefs_all();
+    for(auto &b : expected)
+        EXPECT_THAT(beliefs[b.first], DoubleNear(b.second, 1e-15));
+
+    auto before = threeflocks->get_flock(0)->distribution();
+    EXPECT_THROW(threeflocks->refine_batch({{0, true, 0.5}, {9, true, 0.5}}), std::out_of_range);
+    EXPECT_EQ(threeflocks->get_flock(0)->distribution(), before);
+}
+
+TEST(EliminationTest, LongChain) {
+    std::vector<std::unique_ptr<splittercell::flock>> flocks;
+    std::vector<double> root(8), link(16);
+    for(unsigned int i = 0; i < 8; i++)
+        root[i] = ((i & 1U) ? 0.7 : 0.3) * 0.25;
+    for(unsigned int i = 0; i < 16; i++)
+        link[i] = ((i & 8U) ? ((i & 1U) ? 0.9 : 0.1) : ((i & 1U) ? 0.2 : 0.8)) * 0.25;
+    flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({0,1,2}), std::vector<unsigned int>(), root));
+    for(unsigned int f = 1; f < 15; f++)
+        flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({3*f, 3*f+1, 3*f+2}),
+                                                               std::vector<unsigned int>({3*(f-1)}), link));
+
+    std::vector<const splittercell::flock*> pointers;
+    for(auto &f : flocks)
+        pointers.push_back(f.get());
+    splittercell::elimination engine(pointers);
+    auto joint = engine.joint({42, 43});
+    EXPECT_LE(engine.peak(), 5);
+
+    double expected = 0.7;
+    for(unsigned int f = 1; f < 15; f++)
+        expected = 0.2 + 0.7 * expected;
+    EXPECT_THAT(joint->all_marginals()[joint->index(42)], DoubleEq(expected));
+    EXPECT_THAT(joint->all_marginals()[joint->index(43)], DoubleEq(0.5));
+
+    splittercell::distribution chain(flocks);
+    EXPECT_THAT(chain[{42}][42], DoubleEq(expected));
+
+    /* Every belief at once still builds nothing wider than the elimination of a single flock */
+    std::vector<splittercell::stats::query_report> reports;
+    splittercell::stats::set_query_callback([&reports](const splittercell::stats::query_report &r) {reports.push_back(r);});
+    auto beliefs = chain.beliefs_all();
+    splittercell::stats::set_query_callback(nullptr);
+    if(splittercell::stats::compiled_in()) {
+        ASSERT_EQ(reports.size(), 1U);
+        EXPECT_LE(reports[0].largest_table, 5U);
+    }
+    auto widest = splittercell::factor_cache::footprint(splittercell::flock(std::vector<unsigned int>({0,1,2,3,4})));
+    EXPECT_LE(chain.cache().bytes(), chain.cache().size() * widest);
+    expected = 0.7;
+    for(unsigned int f = 0; f < 15; f++) {
+        EXPECT_THAT(beliefs[3*f], DoubleNear(expected, 1e-12));
+        EXPECT_THAT(beliefs[3*f+1], DoubleNear(0.5, 1e-12));
+        EXPECT_THAT(beliefs[3*f+2], DoubleNear(0.5, 1e-12));
+        expected = 0.2 + 0.7 * expected;
+    }
+}
+
+TEST(EliminationTest, SameAsFullProduct) {
+    auto f1 = std::make_unique<splittercell::flock>(std::vector<unsigned int>({0,1}), std::vector<unsigned int>({2, 4}));
+    auto f2 = std::make_unique<splittercell::flock>(std::vector<unsigned int>({2,3}), std::vector<unsigned int>({4}));
+    auto f3 = std::make_unique<splittercell::flock>(std::vector<unsigned int>({4}));
+    std::vector<double> p1(16);
+    for(unsigned int i = 0; i < 16; i++)
+        p1[i] = (i % 4 + 1) / 10.0;
+    f1->set_probabilities(p1);
+    f2->set_probabilities({0.2, 0.0, 0.0, 0.8, 0.7, 0.0, 0.15, 0.15});
+    f3->set_probabilities({0.4, 0.6});
+
+    auto full = f1->combine(f2.get(), false)->combine(f3.get(), false);
+    auto expected = full->all_marginals();
+    splittercell::elimination engine({f1.get(), f2.get(), f3.get()});
+    auto joint = engine.joint({1, 3});
+    for(unsigned int arg : {1, 3})
+        EXPECT_THAT(joint->all_marginals()[joint->index(arg)], DoubleEq(expected[full->index(arg)]));
+}
+
+TEST(FactorCacheTest, EvictsTheBytesItCounted) {
+    std::vector<unsigned int> args;
+    for(unsigned int i = 0; i < 12; i++)
+        args.push_back(i);
+    std::vector<double> p(1U << 12);
+    for(unsigned int i = 0; i < p.size(); i += 37)
+        p[i] = (i % 7 + 1) / 400.0;
+    auto sparse = std::make_shared<const splittercell::flock>(args, std::vector<unsigned int>(), p);
+    auto b = std::make_shared<const splittercell::flock>(std::vector<unsigned int>({20, 21}));
+    auto c = std::make_shared<const splittercell::flock>(std::vector<unsigned int>({22, 23}));
+    typedef splittercell::factor_cache cache_type;
+    cache_type cache(cache_type::footprint(*sparse) + cache_type::footprint(*b) + cache_type::footprint(*c) - 1);
+    cache.insert("sparse", sparse);
+    cache.insert("b", b);
+    sparse->distribution(); //Grows after it was counted
+    cache.insert("c", c); //Only the oldest goes
+    EXPECT_EQ(cache.size(), 2U);
+    EXPECT_EQ(cache.bytes(), cache_type::footprint(*b) + cache_type::footprint(*c));
+    EXPECT_EQ(cache.find("b"), b);
+}
+
+TEST_F(DistributionTest, FactorCache) {
+    EXPECT_THAT(threeflocks->operator[]({0})[0], DoubleEq(0.49125));
+    auto misses = threeflocks->cache().misses();
+    EXPECT_EQ(threeflocks->cache().hits(), 0);
+    EXPECT_GT(threeflocks->cache().size(), 0);
+
+    /* Only what depends on the first flock is recomputed, the refined belief itself is kept */
+    threeflocks->refine(0, true, 0.5);
+    auto refined = threeflocks->operator[]({0, 1})[0];
+    EXPECT_THAT(refined, DoubleEq(0.49125 + 0.5 * (1 - 0.49125)));
+    EXPECT_GT(threeflocks->cache().hits(), 0);
+    EXPECT_LT(threeflocks->cache().misses(), 2 * misses);
+    splittercell::distribution copy(*threeflocks);
+    EXPECT_EQ(&copy.cache(), &threeflocks->cache()); //Shared, copying does not walk it
+    copy.set_cache_budget(0);
+    EXPECT_EQ(copy.cache().size(), 0);
+    EXPECT_GT(threeflocks->cache().size(), 0);
+    copy.refine(0, true, 0.0);
+    EXPECT_THAT(copy[{0}][0], DoubleEq(refined));
+}
+
+TEST_F(DistributionTest, ExactBeliefsAfterRefine) {
+    /* Everything computed from scratch on copies of the flocks */
+    auto fresh = [this] {
+        std::vector<std::unique_ptr<splittercell::flock>> flocks;
+        for(unsigned int f = 0; f < 3; f++)
+            flocks.push_back(std::make_unique<splittercell::flock>(*threeflocks->get_flock(f)));
+        return splittercell::distribution(flocks).beliefs_all();
+    };
+    threeflocks->beliefs_all();
+    /* Refined argument, then how many beliefs are still cached: the refined one and those not downstream of it */
+    std::vector<std::pair<unsigned int, unsigned int>> moves({{4, 1}, {0, 5}, {2, 3}});
+    for(auto &move : moves) {
+        threeflocks->refine(move.first, true, 0.3);
+        std::vector<splittercell::stats::query_report> reports;
+        splittercell::stats::set_query_callback([&reports](const splittercell::stats::query_report &r) {reports.push_back(r);});
+        auto beliefs = threeflocks->beliefs_all();
+        splittercell::stats::set_query_callback(nullptr);
+        auto expected = fresh();
+        for(auto &b : expected)
+            EXPECT_THAT(beliefs[b.first], DoubleNear(b.second, 1e-15));
+        if(splittercell::stats::compiled_in()) {
+            ASSERT_EQ(reports.size(), 1U);
+            EXPECT_EQ(reports[0].belief_hits, move.second);
+        }
+    }
+    threeflocks->set_probabilities(2, {0.9, 0.1});
+    auto expected = fresh();
+    for(auto &b : threeflocks->beliefs_all())
+        EXPECT_THAT(b.second, DoubleNear(expected[b.first], 1e-15));
+}
+
+TEST_F(DistributionTest, Approximate) {
+    threeflocks->refine(4, true, 0.3);
+    auto exact = threeflocks->beliefs_all();
+    splittercell::sampling_budget budget;
+    budget.max_error = 0.005;
+    budget.seconds   = 0;
+    auto approximate = threeflocks->approximate({0, 1, 2, 3, 4}, budget);
+    EXPECT_TRUE(approximate.converged);
+    EXPECT_LE(approximate.max_error, 0.005);
+    for(auto &b : exact) {
+        EXPECT_THAT(approximate.beliefs[b.first], DoubleNear(b.second, 0.015));
+        EXPECT_LT(approximate.intervals[b.first].first, approximate.beliefs[b.first]);
+        EXPECT_GT(approximate.intervals[b.first].second, approximate.beliefs[b.first]);
+    }
+
+    /* Same samples whatever the threads */
+    splittercell::sampling_budget fixed;
+    fixed.max_error   = 0;
+    fixed.max_samples = 100000;
+    fixed.seed        = 7;
+    auto parallel = threeflocks->approximate({0, 3}, fixed);
+    threeflocks->disable_mt();
+    auto sequential = threeflocks->approximate({0, 3}, fixed);
+    EXPECT_EQ(parallel.samples, 100000U);
+    EXPECT_FALSE(parallel.converged);
+    EXPECT_EQ(parallel.beliefs, sequential.beliefs);
+
+    EXPECT_THAT(empty->approximate({2}).beliefs[2], DoubleNear(0.5, 0.01));
+    EXPECT_THROW(threeflocks->approximate({0}, {0, 0, 0}), std::invalid_argument);
+}
+
+TEST_F(DistributionTest, WhatIf) {
+    threeflocks->operator[]({0, 4});
+    auto before = threeflocks->to_str();
+    auto flock = threeflocks->get_flock(1);
+    std::vector<splittercell::update> candidates({{4, true, 0.3}, {0, false, 0.5}, {2, true, 0.7}, {3, false, 1.0}});
+    std::vector<unsigned int> targets({0, 1, 2, 3, 4});
+    auto outcomes = threeflocks->what_if(candidates, targets);
+    ASSERT_EQ(outcomes.size(), candidates.size());
+    for(std::size_t c = 0; c < candidates.size(); c++) {
+        splittercell::distribution applied(*threeflocks);
+        applied.refine(candidates[c].argument, candidates[c].positive, candidates[c].coefficient);
+        auto expected = applied[targets];
+        for(auto arg : targets)
+            EXPECT_THAT(outcomes[c][arg], DoubleNear(expected[arg], 1e-15));
+    }
+    EXPECT_EQ(threeflocks->to_str(), before);
+    EXPECT_EQ(threeflocks->get_flock(1), flock);
+
+    /* The same candidates again only use cached factors */
+    auto misses = threeflocks->cache().misses();
+    EXPECT_EQ(threeflocks->what_if(candidates, targets), outcomes);
+    EXPECT_EQ(threeflocks->cache().misses(), misses);
+    EXPECT_THROW(empty->what_if({{0, true, 0.5}}, {0}), std::invalid_argument);
+}
+
+TEST_F(DistributionTest, SnapshotSharesFlocks) {
+    splittercell::distribution snapshot(*threeflocks);
+    EXPECT_EQ(snapshot.get_flock(1), threeflocks->get_flock(1));
+    std::vector<unsigned int> args({0, 3});
+    auto before = snapshot[args];
+    threeflocks->refine(3, true, 0.5);
+    EXPECT_NE(snapshot.get_flock(1), threeflocks->get_flock(1));
+    EXPECT_EQ(snapshot.get_flock(0), threeflocks->get_flock(0));
+    EXPECT_EQ(snapshot[args], before);
+}
+
+TEST_F(DistributionTest, Rollback) {
+    auto before = threeflocks->beliefs_all();
+    auto table = threeflocks->get_flock(0)->distribution();
+    EXPECT_EQ(threeflocks->checkpoint(), 1);
+    threeflocks->refine(0, true, 0.5);
+    threeflocks->checkpoint();
+    threeflocks->refine(3, false, 1.0);
+    threeflocks->commit();
+    EXPECT_EQ(threeflocks->checkpoints(), 1);
+    EXPECT_NE(threeflocks->beliefs_all(), before);
+    threeflocks->rollback();
+    EXPECT_EQ(threeflocks->get_flock(0)->distribution(), table);
+    EXPECT_EQ(threeflocks->beliefs_all(), before);
+    EXPECT_THROW(threeflocks->rollback(), std::logic_error);
+}
+
+/* The chain of the threeflocks fixture, refined, in representation S */
+template<typename S>
+std::unordered_map<unsigned int, double> chain_beliefs() {
+    typedef splittercell::basic_flock<S> flock_type;
+    std::vector<std::unique_ptr<flock_type>> flocks;
+    flocks.push_back(std::make_unique<flock_type>(std::vector<unsigned int>({0,1}), std::vector<unsigned int>({2})));
+    flocks.push_back(std::make_unique<flock_type>(std::vector<unsigned int>({2,3}), std::vector<unsigned int>({4})));
+    flocks.push_back(std::make_unique<flock_type>(std::vector<unsigned int>({4})));
+    splittercell::basic_distribution<S> d(flocks);
+    std::vector<typename flock_type::value_type> table;
+    for(double p : {0.2, 0.0, 0.0, 0.8, 0.7, 0.0, 0.15, 0.15})
+        table.push_back(flock_type::traits::from_probability(p));
+    d.set_probabilities(0, table);
+    d.set_probabilities(1, table);
+    d.refine(0, true, 0.5);
+    d.refine(4, false, 0.25);
+    return d.beliefs_all();
+}
+
+TEST(ScalarTest, SameBeliefsInEveryRepresentation) {
+    auto expected = chain_beliefs<double>();
+    auto single = chain_beliefs<float>();
+    auto logs = chain_beliefs<splittercell::log_space<double>>();
+    for(auto &b : expected) {
+        EXPECT_THAT(single[b.first], DoubleNear(b.second, 1e-6));
+        EXPECT_THAT(logs[b.first], DoubleNear(b.second, 1e-12));
+    }
+}
+
+TEST(ScalarTest, LogSpaceDoesNotUnderflow) {
+    splittercell::log_flock a({0}, {}, {std::log(1 - 1e-200), std::log(1e-200)}), b({1}, {}, {std::log(1 - 1e-200), std::log(1e-200)});
+    auto product = a.combine(&b);
+    EXPECT_THAT(product->distribution()[3], DoubleNear(-400 * std::log(10.0), 1e-9));
+    EXPECT_THAT(product->all_marginals()[0], DoubleNear(1e-200, 1e-210));
+
+    splittercell::flock c({0}, {}, {1 - 1e-200, 1e-200}), d({1}, {}, {1 - 1e-200, 1e-200});
+    EXPECT_EQ(c.combine(&d)->distribution()[3], 0.0);
+}
+
+TEST(KernelTest, FloatSameOnEveryIsa) {
+    std::vector<float> reference(1U << 10);
+    for(unsigned int i = 0; i < reference.size(); i++)
+        reference[i] = (i % 7) / 3000.0f;
+    splittercell::kernels::set_isa(splittercell::kernels::isa::scalar);
+    std::vector<float> expected_marginals(10, 0.0f);
+    splittercell::kernels::marginals(reference.data(), 10, expected_marginals.data(), 0, reference.size());
+    for(unsigned int index = 0; index < 10; index++) {
+        splittercell::kernels::set_isa(splittercell::kernels::isa::scalar);
+        auto expected = reference;
+        splittercell::kernels::refine(expected.data(), expected.size(), index, index % 2, 0.3);
+        for(auto level : {splittercell::kernels::isa::sse2, splittercell::kernels::isa::avx2}) {
+            splittercell::kernels::set_isa(level);
+            auto actual = reference;
+            splittercell::kernels::refine(actual.data(), actual.size(), index, index % 2, 0.3);
+            EXPECT_THAT(actual, ElementsAreArray(expected));
+        }
+    }
+    std::vector<float> marginals(10, 0.0f);
+    splittercell::kernels::marginals(reference.data(), 10, marginals.data(), 0, reference.size());
+    for(unsigned int b = 0; b < 10; b++)
+        EXPECT_NEAR(marginals[b], expected_marginals[b], 1e-3);
+    splittercell::kernels::set_isa(splittercell::kernels::detected_isa());
+}
+
+TEST(StorageTest, MappedTables) {
+    auto previous = splittercell::storage::current_policy();
+    auto before = splittercell::storage::mapped_bytes();
+    std::vector<unsigned int> args1, args2;
+    for(unsigned int a = 0; a < 8; a++)
+        (a % 2 ? args1 : args2).push_back(a);
+    splittercell::flock f1(args1, {args2[0]}), f2(args2);
+    f1.refine(args1[1], true, 0.4);
+    f2.refine(args2[2], false, 0.7);
+    auto expected = f1.combine(&f2);
+
+    for(auto directory : {std::string(), ::testing::TempDir()}) {
+        splittercell::storage::set_policy({0, directory});
+        splittercell::flock m1(f1), m2(f2);
+        auto combined = m1.combine(&m2);
+        EXPECT_GT(splittercell::storage::mapped_bytes(), before);
+        EXPECT_THAT(combined->distribution(), ElementsAreArray(expected->distribution()));
+        EXPECT_THAT(combined->marginalize({args1[0], args2[1]})->distribution(),
+                    ElementsAreArray(expected->marginalize({args1[0], args2[1]})->distribution()));
+        splittercell::storage::set_policy(previous);
+    }
+    EXPECT_EQ(splittercell::storage::mapped_bytes(), before);
+}
+
+/* Chain of flocks of three arguments, each conditioned on the first argument of the previous one by a table that
+ * depends on it, so that a refinement changes the beliefs downstream */
+static splittercell::distribution correlated_chain(unsigned int flocks) {
+    std::vector<std::unique_ptr<splittercell::flock>> v;
+    for(unsigned int f = 0; f < flocks; f++) {
+        std::vector<unsigned int> cond;
+        if(f)
+            cond.push_back(3 * f - 3);
+        std::vector<double> p(std::size_t(1) << (3 + cond.size()));
+        for(std::size_t c = 0; c < p.size(); c += 8) { //Sums to one in each configuration of the conditioning
+            double total = 0;
+            for(std::size_t m = c; m < c + 8; m++)
+                total += p[m] = 1 + (7 * m + f) % 5;
+            for(std::size_t m = c; m < c + 8; m++)
+                p[m] /= total;
+        }
+        v.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({3 * f, 3 * f + 1, 3 * f + 2}), cond, p));
+    }
+    return splittercell::distribution(v);
+}
+
+TEST(ObserveTest, SameAsRefiningTheJoint) {
+    auto d = correlated_chain(4);
+    std::vector<unsigned int> all;
+    for(unsigned int a = 0; a < 12; a++)
+        all.push_back(a);
+    /* Beliefs in the product of every flock, with the observed arguments refined to their values with a coefficient of 1 */
+    auto refined = [&all](const std::vector<std::pair<unsigned int, bool>> &evidence) {
+        auto chain = correlated_chain(4);
+        std::vector<std::unique_ptr<splittercell::flock>> flocks;
+        for(unsigned int f = 0; f < 4; f++)
+            flocks.push_back(std::make_unique<splittercell::flock>(*chain.get_flock(f)));
+        for(auto &e : evidence)
+            flocks[e.first / 3]->refine(e.first, e.second, 1.0);
+        auto joint = flocks[0]->combine(flocks[1].get());
+        for(unsigned int f = 2; f < 4; f++)
+            joint = joint->combine(flocks[f].get());
+        std::vector<double> beliefs(all.size(), 0.0);
+        auto &t = joint->distribution();
+        for(std::size_t m = 0; m < t.size(); m++)
+            for(auto a : all)
+                if((m >> joint->index(a)) & 1)
+                    beliefs[a] += t[m];
+        return beliefs;
+    };
+
+    d.beliefs_all(); //Cached, so the observations have to invalidate them
+    std::vector<std::pair<unsigned int, bool>> evidence;
+    for(auto e : {std::make_pair(4U, true), std::make_pair(0U, true), std::make_pair(1U, false), std::make_pair(2U, true)}) {
+        d.observe(e.first, e.second);
+        evidence.push_back(e);
+        auto expected = refined(evidence);
+        auto beliefs = d[all];
+        for(auto a : all)
+            EXPECT_THAT(beliefs[a], DoubleNear(expected[a], 1e-12));
+    }
+    EXPECT_EQ(d.get_flock(0)->size(), 0);
+    EXPECT_EQ(d.get_flock(1)->distribution().size(), 4);
+    EXPECT_TRUE(d.get_flock(1)->conditioning().empty());
+    EXPECT_THROW(d.refine(0, true, 0.5), std::invalid_argument);
+    EXPECT_THROW(d.observe(1, true), std::invalid_argument);
+
+    auto before = d.beliefs_all();
+    d.checkpoint();
+    d.observe(7, true);
+    d.observe(6, false);
+    EXPECT_EQ(d.get_flock(2)->size(), 2);
+    EXPECT_NE(d.beliefs_all(), before);
+    d.rollback();
+    EXPECT_EQ(d.beliefs_all(), before);
+    EXPECT_EQ(d.get_flock(2)->size(), 4);
+    d.refine(7, true, 0.5);
+
+    /* Evidence on an argument of a flock conditioned on another one is not pushed up to it */
+    std::vector<std::unique_ptr<splittercell::flock>> flocks;
+    flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({0}), std::vector<unsigned int>(), std::vector<double>({0.5, 0.5})));
+    flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({1, 2}), std::vector<unsigned int>({0}),
+                                                           std::vector<double>({0.85, 0.05, 0.05, 0.05, 0.05, 0.05, 0.05, 0.85})));
+    splittercell::distribution pair(flocks);
+    pair.observe(1, true);
+    auto beliefs = pair[{0, 1, 2}];
+    EXPECT_THAT(beliefs[0], DoubleEq(0.5));
+    EXPECT_THAT(beliefs[1], DoubleEq(1.0));
+    EXPECT_THAT(beliefs[2], DoubleNear(0.5, 1e-15));
+}
+
+TEST(ObserveTest, SparseSameAsFullTable) {
+    std::vector<unsigned int> args;
+    for(unsigned int i = 0; i < 11; i++)
+        args.push_back(i);
+    std::vector<double> p(1U << 12);
+    for(unsigned int i = 0; i < p.size(); i += 29)
+        p[i] = (i % 5 + 1) / 100.0;
+    splittercell::flock sparse(args, {11}, p), dense(args, {11}, splittercell::table<double>(p.cbegin(), p.cend()), false);
+    ASSERT_TRUE(sparse.sparse());
+    for(auto f : {&sparse, &dense}) {
+        f->observe(4, true);
+        f->observe(11, false);
+        f->observe(0, false);
+        EXPECT_EQ(f->size(), 9);
+    }
+    ASSERT_EQ(sparse.distribution().size(), dense.distribution().size());
+    for(std::size_t i = 0; i < dense.distribution().size(); i++)
+        EXPECT_THAT(sparse.distribution()[i], DoubleNear(dense.distribution()[i], 1e-15));
+
+    /* 0 is never true when 2 is false, 1 keeps its marginal in both configurations of 2 */
+    splittercell::flock small({0, 1}, {2}, {0.1, 0.0, 0.2, 0.0, 0.5, 0.0, 0.1, 0.1});
+    small.observe(0, true);
+    EXPECT_THAT(small.distribution(), ElementsAreArray({DoubleEq(0.1), DoubleEq(0.2), DoubleEq(0.5), DoubleEq(0.2)}));
+}
+
+TEST(StorageTest, WorkspaceReusesTables) {
+    auto d = correlated_chain(6);
+    d.set_cache_budget(0);
+    auto move = [&d](unsigned int m) {
+        d.refine(0, m % 2, 0.2);
+        d.refine(15, m % 2, 0.2);
+    };
+    for(unsigned int m = 0; m < 2; m++) {
+        move(m);
+        d[{17}];
+    }
+    auto fresh = d.workspace().fresh();
+    EXPECT_GT(fresh, 0u);
+    for(unsigned int m = 0; m < 10; m++) {
+        move(m);
+        splittercell::distribution snapshot(d); //Starts with an empty workspace
+        EXPECT_DOUBLE_EQ(d[{17}][17], snapshot[{17}][17]);
+    }
+    EXPECT_EQ(d.workspace().fresh(), fresh);
+    EXPECT_GE(d.workspace().reused(), 10u);
+
+    /* Tables outliving their workspace are freed as usual */
+    std::unique_ptr<splittercell::flock> kept;
+    {
+        splittercell::storage::workspace w;
+        splittercell::storage::workspace::scope scope(&w);
+        kept = d.get_flock(0)->combine(d.get_flock(1));
+        EXPECT_EQ(w.fresh(), 1u);
+    }
+    EXPECT_EQ(kept->distribution().size(), 64u);
+}
+
+TEST(SnapshotTest, ReadersSeeWholePublications) {
+    auto d = correlated_chain(6);
+    std::vector<unsigned int> all;
+    for(unsigned int a = 0; a < 18; a++)
+        all.push_back(a);
+    const unsigned int publications = 20;
+    std::vector<std::unordered_map<unsigned int, double>> expected(publications + 1);
+    EXPECT_EQ(d.published(), nullptr);
+    expected[1] = splittercell::distribution(d).beliefs_all(); //On a copy, so that the readers compute them
+    d.publish();
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned int> reads(0), mismatches(0);
+    std::vector<std::thread> readers;
+    for(unsigned int t = 0; t < 4; t++)
+        readers.emplace_back([&]() {
+            do {
+                auto s = d.published();
+                auto b = (*s)[all];
+                for(auto a : all)
+                    if(std::abs(b[a] - expected[s->generation()][a]) > 1e-12)
+                        mismatches++;
+                reads++;
+            } while(!done);
+        });
+    for(unsigned int g = 2; g <= publications; g++) {
+        d.refine(0, g % 2, 0.2);
+        d.refine(3 * (g % 6) + 1, true, 0.1);
+        expected[g] = splittercell::distribution(d).beliefs_all();
+        d.publish();
+    }
+    done = true;
+    for(auto &r : readers)
+        r.join();
+    EXPECT_EQ(mismatches, 0u);
+    EXPECT_GE(reads, 4u);
+    EXPECT_EQ(d.published()->generation(), publications);
+    EXPECT_THAT((*d.published())[{17}][17], DoubleNear(d[{17}][17], 1e-12));
+}
+
+TEST(SparseTest, SameAsFullTable) {
+    std::vector<unsigned int> args1, args2;
+    for(unsigned int i = 0; i < 12; i++)
+        args1.push_back(i);
+    for(unsigned int i = 12; i < 21; i++)
+        args2.push_back(i);
+    std::vector<double> p1(1U << 12), p2(1U << 10);
+    for(unsigned int i = 0; i < p1.size(); i += 37)
+        p1[i] = (i % 7 + 1) / 400.0;
+    for(unsigned int i = 0; i < p2.size(); i += 29)
+        p2[i] = (i % 5 + 1) / 100.0;
+    splittercell::flock sparse1(args1, {}, p1), sparse2(args2, {3}, p2);
+    splittercell::flock dense1(args1, {}, splittercell::table<double>(p1.cbegin(), p1.cend()), false);
+    splittercell::flock dense2(args2, {3}, splittercell::table<double>(p2.cbegin(), p2.cend()), false);
+    ASSERT_TRUE(sparse1.sparse() && sparse2.sparse());
+    ASSERT_FALSE(dense1.sparse() || dense2.sparse());
+    EXPECT_LT(sparse1.table_bytes(), dense1.table_bytes() / 4);
+    EXPECT_EQ(sparse1, dense1);
+
+    auto same = [](const splittercell::table<double> &actual, const splittercell::table<double> &expected) {
+        ASSERT_EQ(actual.size(), expected.size());
+        for(std::size_t i = 0; i < expected.size(); i++)
+            EXPECT_THAT(actual[i], DoubleNear(expected[i], 1e-15));
+    };
+    auto expected = dense1.combine(&dense2);
+    for(auto pair : {std::make_pair(&sparse1, &sparse2), std::make_pair(&sparse1, &dense2), std::make_pair(&dense1, &sparse2)}) {
+        auto product = pair.first->combine(pair.second);
+        EXPECT_TRUE(product->sparse());
+        same(product->distribution(), expected->distribution());
+    }
+    same(sparse1.marginalize({7, 1, 5})->distribution(), dense1.marginalize({7, 1, 5})->distribution());
+    auto m1 = sparse1.all_marginals(), m2 = dense1.all_marginals();
+    for(unsigned int b = 0; b < m1.size(); b++)
+        EXPECT_THAT(m1[b], DoubleNear(m2[b], 1e-15));
+
+    for(auto f : {&sparse1, &dense1}) {
+        f->refine(4, true, 0.3);
+        f->refine(0, false, 1.0);
+        f->refine_batch({{2, true, 0.5}, {11, false, 0.25}, {2, false, 0.1}});
+    }
+    EXPECT_TRUE(sparse1.sparse());
+    EXPECT_TRUE(dense1.sparse()); //Emptied by the refinement with coefficient 1
+    same(sparse1.distribution(), dense1.distribution());
+
+    std::vector<std::unique_ptr<splittercell::flock>> s, d;
+    s.push_back(std::make_unique<splittercell::flock>(args1, std::vector<unsigned int>(), p1));
+    s.push_back(std::make_unique<splittercell::flock>(args2, std::vector<unsigned int>({3}), p2));
+    d.push_back(std::make_unique<splittercell::flock>(args1, std::vector<unsigned int>(), splittercell::table<double>(p1.cbegin(), p1.cend()), false));
+    d.push_back(std::make_unique<splittercell::flock>(args2, std::vector<unsigned int>({3}), splittercell::table<double>(p2.cbegin(), p2.cend()), false));
+    splittercell::distribution sparse_model(s), dense_model(d);
+    auto b1 = sparse_model.beliefs_all(), b2 = dense_model.beliefs_all();
+    for(auto &b : b2)
+        EXPECT_THAT(b1[b.first], DoubleNear(b.second, 1e-12));
+
+    sparse1.set_probabilities(std::vector<double>(1U << 12, 1.0 / 4096));
+    EXPECT_FALSE(sparse1.sparse());
+    EXPECT_THROW(splittercell::flock(args1, {}, std::vector<std::size_t>({3, 2}), std::vector<double>({0.5, 0.5})), std::invalid_argument);
+}
+
+TEST(SparseTest, ReadersKeepItSparse) {
+    std::vector<unsigned int> args;
+    for(unsigned int i = 0; i < 12; i++)
+        args.push_back(i);
+    std::vector<double> p(1U << 12);
+    for(unsigned int i = 0; i < p.size(); i += 37)
+        p[i] = (i % 7 + 1) / 400.0;
+    std::vector<std::unique_ptr<splittercell::flock>> s, d;
+    s.push_back(std::make_unique<splittercell::flock>(args, std::vector<unsigned int>(), p));
+    d.push_back(std::make_unique<splittercell::flock>(args, std::vector<unsigned int>(), splittercell::table<double>(p.cbegin(), p.cend()), false));
+    splittercell::distribution_batch batch(s, 3);
+    splittercell::distribution sparse_model(s), dense_model(d);
+    auto f = sparse_model.get_flock(0);
+    ASSERT_TRUE(f->sparse());
+    auto bytes = f->table_bytes();
+
+    std::stringstream sparse_file, dense_file;
+    sparse_model.save(sparse_file);
+    dense_model.save(dense_file);
+    EXPECT_EQ(sparse_file.str(), dense_file.str());
+    EXPECT_EQ(f->to_str(), dense_model.get_flock(0)->to_str());
+    EXPECT_TRUE(*f == *dense_model.get_flock(0));
+    EXPECT_TRUE(*dense_model.get_flock(0) == *f);
+    EXPECT_THAT(batch.probabilities(2, 0), ElementsAreArray(p));
+    EXPECT_EQ(f->table_bytes(), bytes);
+
+    f->distribution(); //Kept until the next change
+    EXPECT_GT(f->table_bytes(), bytes);
+}
+
+TEST_F(DistributionTest, SaveAndLoad) {
+    threeflocks->refine(0, true, 0.5);
+    std::vector<unsigned int> some({0, 2});
+    auto queried = (*threeflocks)[some];
+    auto path = ::testing::TempDir() + "/threeflocks.sc";
+    threeflocks->save(path);
+
+    auto loaded = splittercell::distribution::load(path);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(loaded.get_flock(1)->distribution().data()) % splittercell::serialization::alignment, 0U);
+    for(unsigned int f = 0; f < 3; f++)
+        EXPECT_EQ(*loaded.get_flock(f), *threeflocks->get_flock(f));
+    EXPECT_EQ(loaded[some], queried);
+    EXPECT_EQ(loaded.beliefs_all(), threeflocks->beliefs_all());
+
+    /* Changes stay in memory */
+    loaded.refine(3, true, 1.0);
+    EXPECT_NE(loaded.get_flock(1)->distribution(), threeflocks->get_flock(1)->distribution());
+    EXPECT_EQ(splittercell::distribution::load(path).get_flock(1)->distribution(), threeflocks->get_flock(1)->distribution());
+
+    std::stringstream stream;
+    empty->save(stream);
+    EXPECT_EQ(stream.str().size(), sizeof(splittercell::serialization::file_header) + 4 * sizeof(splittercell::serialization::argument_record));
+    EXPECT_THROW(splittercell::float_distribution::load(path), std::runtime_error);
+
+    /* Saved onto the file its tables are still mapped from */
+    splittercell::distribution copy(loaded);
+    copy.save(path);
+    EXPECT_EQ(splittercell::distribution::load(path).beliefs_all(), copy.beliefs_all());
+    EXPECT_EQ(loaded.get_flock(0)->distribution(), threeflocks->get_flock(0)->distribution());
+    EXPECT_EQ(loaded.beliefs_all(), copy.beliefs_all());
+}
+
+TEST_F(DistributionTest, LoadRejectsCorruptedFiles) {
+    using namespace splittercell::serialization;
+    std::stringstream stream;
+    dist->save(stream);
+    const std::string saved = stream.str();
+    auto path = ::testing::TempDir() + "/corrupted.sc";
+    auto with = [](std::string bytes, std::size_t offset, auto value) {
+        return bytes.replace(offset, sizeof(value), reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    auto rejected = [&](const std::string &bytes) {
+        std::ofstream(path, std::ios::binary) << bytes;
+        EXPECT_THROW(splittercell::distribution::load(path), std::runtime_error);
+    };
+    std::size_t flock = sizeof(file_header), records = flock + sizeof(flock_header) + 2 * sizeof(std::uint32_t);
+    //2^62 models of 8 bytes overflow the size of the table
+    rejected(with(with(saved, flock + offsetof(flock_header, conditioned), std::uint32_t(62)), flock + offsetof(flock_header, models),
+                  std::uint64_t(1) << 62));
+    rejected(with(saved, records + sizeof(argument_record) + offsetof(argument_record, argument), std::uint32_t(0))); //Twice the same argument
+    rejected(with(saved, records + offsetof(argument_record, argument), std::uint32_t(7))); //Not in the flock that claims it
+    rejected(with(saved, records + offsetof(argument_record, flock), no_flock)); //Left without its flock
+
+    /* 1 is observed, outside every flock, then the second flock is made conditioned on it or on an unknown argument */
+    auto chain = correlated_chain(2);
+    chain.observe(1, true);
+    std::stringstream chain_stream;
+    chain.save(chain_stream);
+    const std::string chain_saved = chain_stream.str();
+    std::size_t conditioning = sizeof(file_header) + 2 * sizeof(flock_header) + (2 + 3) * sizeof(std::uint32_t);
+    ASSERT_EQ(chain.get_flock(1)->conditioning(), std::vector<unsigned int>({0}));
+    rejected(with(chain_saved, conditioning, std::uint32_t(1)));
+    rejected(with(chain_saved, conditioning, std::uint32_t(99)));
+    std::ofstream(path, std::ios::binary) << chain_saved;
+    EXPECT_EQ(splittercell::distribution::load(path).beliefs_all(), chain.beliefs_all());
+
+    std::ofstream(path, std::ios::binary) << saved;
+    EXPECT_EQ(splittercell::distribution::load(path).beliefs_all(), dist->beliefs_all());
+}
+
+TEST_F(DistributionTest, Stats) {
+    splittercell::stats::reset();
+    std::vector<splittercell::stats::query_report> reports;
+    splittercell::stats::set_query_callback([&reports](const splittercell::stats::query_report &r) {reports.push_back(r);});
+    threeflocks->refine(0, true, 0.5);
+    threeflocks->beliefs_all();
+    threeflocks->beliefs_all();
+    splittercell::stats::set_query_callback(nullptr);
+    auto s = splittercell::stats::current();
+
+    if(!splittercell::stats::compiled_in()) {
+        EXPECT_TRUE(reports.empty());
+        EXPECT_EQ(s.queries, 0U);
+        return;
+    }
+    ASSERT_EQ(reports.size(), 2U);
+    EXPECT_EQ(reports[0].arguments, 5U);
+    EXPECT_GT(reports[0].belief_misses, 0U);
+    EXPECT_GE(reports[0].largest_table, 3U);
+    EXPECT_EQ(reports[1].belief_hits, 5U);
+    EXPECT_EQ(reports[1].belief_misses, 0U);
+    EXPECT_EQ(s.queries, 2U);
+    EXPECT_GT(s.combines, 0U);
+    EXPECT_GE(s.largest_combined, 3U);
+    EXPECT_GT(s.factor_misses, 0U);
+    EXPECT_GT(s.bytes_allocated, 0U);
+    EXPECT_EQ(s.kernel_calls[static_cast<unsigned int>(splittercell::stats::kernel::refine)], 1U);
+    EXPECT_GT(s.kernel_calls[static_cast<unsigned int>(splittercell::stats::kernel::elimination)], 0U);
+}
+
+TEST(ArgumentMapTest, DenseThenSparse) {
+    splittercell::argument_map map;
+    for(unsigned int a = 0; a < 10; a++)
+        map.insert(a, 9 - a);
+    EXPECT_TRUE(map.dense());
+    EXPECT_EQ(map.at(3), 6);
+    EXPECT_FALSE(map.contains(10));
+    map.insert(1000000, 10);
+    EXPECT_FALSE(map.dense());
+    EXPECT_EQ(map.at(3), 6);
+    EXPECT_EQ(map.at(1000000), 10);
+    EXPECT_EQ(map.size(), 11);
+    EXPECT_THROW(map.at(11), std::out_of_range);
+}
+
+TEST(ArgumentMapTest, SparseIdentifiers) {
+    auto f1 = std::make_unique<splittercell::flock>(std::vector<unsigned int>({4000000000U, 7}));
+    auto f2 = std::make_unique<splittercell::flock>(std::vector<unsigned int>({123456}), std::vector<unsigned int>({7}));
+    f1->set_probabilities({0.1, 0.2, 0.1, 0.6});
+    f2->set_probabilities({0.5, 0.5, 0.0, 1.0});
+    std::vector<std::unique_ptr<splittercell::flock>> flocks;
+    flocks.push_back(std::move(f1));
+    flocks.push_back(std::move(f2));
+    splittercell::distribution d(flocks);
+    EXPECT_FALSE(d.dense_ids());
+    auto b = d[{4000000000U, 7, 123456}];
+    EXPECT_THAT(b[4000000000U], DoubleEq(0.8));
+    EXPECT_THAT(b[7], DoubleEq(0.7));
+    EXPECT_THAT(b[123456], DoubleEq(0.85));
+    EXPECT_THROW(d.refine(8, true, 1.0), std::out_of_range);
+}
+
+TEST(BatchTest, SameAsOneDistributionPerSession) {
+    auto make = [] {
+        std::vector<std::unique_ptr<splittercell::flock>> flocks;
+        flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({0,1}), std::vector<unsigned int>({2})));
+        flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({2,3}), std::vector<unsigned int>({4})));
+        flocks.push_back(std::make_unique<splittercell::flock>(std::vector<unsigned int>({4})));
+        flocks[0]->set_probabilities({0.2, 0.0, 0.0, 0.8, 0.7, 0.0, 0.15, 0.15});
+        flocks[1]->set_probabilities({0.2, 0.0, 0.0, 0.8, 0.7, 0.0, 0.15, 0.15});
+        return flocks;
+    };
+    const unsigned int sessions = 37;
+    auto topology = make();
+    splittercell::distribution_batch batch(topology, sessions, std::make_shared<splittercell::thread_pool>(4));
+    std::vector<double> coefficients;
+    for(unsigned int s = 0; s < sessions; s++) {
+        batch.set_probabilities(s, 2, {1.0 - s / 40.0, s / 40.0});
+        coefficients.push_back(s / 50.0);
+    }
+    batch.refine(2, true, coefficients);
+    batch.refine(1, false, 0.3);
+    auto beliefs = batch[{0, 1, 3}];
+
+    for(unsigned int s = 0; s < sessions; s++) {
+        auto flocks = make();
+        splittercell::distribution single(flocks);
+        single.set_probabilities(2, {1.0 - s / 40.0, s / 40.0});
+        single.refine(2, true, coefficients[s]);
+        single.refine(1, false, 0.3);
+        EXPECT_THAT(batch.probabilities(s, 1), ElementsAreArray(single.get_flock(1)->distribution()));
+        auto expected = single[{0, 1, 3}];
+        for(unsigned int arg : {0, 1, 3})
+            EXPECT_THAT(beliefs[arg][s], DoubleEq(expected[arg]));
+    }
+    EXPECT_THROW(batch.refine(2, true, std::vector<double>(sessions - 1, 0.1)), std::invalid_argument);
+
+    batch.set_plan_limit(2);
+    EXPECT_EQ(batch.cached_plans(), 1U);
+    for(auto &key : std::vector<std::vector<unsigned int>>({{0}, {1}, {0, 1, 3}, {2}, {3}}))
+        batch[key];
+    EXPECT_EQ(batch.cached_plans(), 2U);
+    auto again = batch[{0, 1, 3}]; //Evicted, planned again
+    for(unsigned int arg : {0, 1, 3})
+        EXPECT_THAT(again[arg], ElementsAreArray(beliefs[arg]));
+}